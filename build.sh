@@ -4,12 +4,40 @@ BUILD=${1:-debug}  # default to debug if no argument given
 
 if [[ "$BUILD" == "debug" ]]; then
     mkdir -p build/linux-x64-debug
-    g++ -g -Iinclude source/profiler.cpp -shared -fPIC -std=c++20 \
-        -o build/linux-x64-debug/profiler.so
+    g++ -g -Iinclude -Isource source/profiler.cpp source/symbolizer.cpp source/fleet.cpp \
+        -shared -fPIC -std=c++20 -o build/linux-x64-debug/profiler.so
+    g++ -g -Iinclude -Isource tools/trace_analyzer.cpp source/fleet.cpp -std=c++20 -pthread \
+        -o build/linux-x64-debug/trace_analyzer
+    g++ -g -DMAX_AUTO_BLOCKS=256 -Iinclude -Isource source/profiler.cpp source/symbolizer.cpp \
+        source/fleet.cpp -shared -fPIC -std=c++20 -o build/linux-x64-debug/profiler_auto.so
+    g++ -g -DMAX_AUTO_BLOCKS=256 -Iinclude -Isource examples/auto_instrument.cpp -std=c++20 -pthread -rdynamic \
+        -finstrument-functions -finstrument-functions-exclude-file-list=include/,source/ \
+        build/linux-x64-debug/profiler_auto.so -Wl,-rpath,'$ORIGIN' \
+        -o build/linux-x64-debug/auto_instrument
+    g++ -g -Iinclude -Isource examples/scope_overhead.cpp -std=c++20 -pthread \
+        build/linux-x64-debug/profiler.so -Wl,-rpath,'$ORIGIN' \
+        -o build/linux-x64-debug/scope_overhead
+    g++ -g -DPROFILER_INLINE -Iinclude -Isource examples/scope_overhead.cpp -std=c++20 -pthread \
+        build/linux-x64-debug/profiler.so -Wl,-rpath,'$ORIGIN' \
+        -o build/linux-x64-debug/scope_overhead_inline
 elif [[ "$BUILD" == "release" ]]; then
     mkdir -p build/linux-x64-release
-    g++ -O2 -DNDEBUG -Iinclude source/profiler.cpp -shared -fPIC -std=c++20 \
-        -o build/linux-x64-release/profiler.so
+    g++ -O2 -DNDEBUG -Iinclude -Isource source/profiler.cpp source/symbolizer.cpp source/fleet.cpp \
+        -shared -fPIC -std=c++20 -o build/linux-x64-release/profiler.so
+    g++ -O2 -DNDEBUG -Iinclude -Isource tools/trace_analyzer.cpp source/fleet.cpp -std=c++20 -pthread \
+        -o build/linux-x64-release/trace_analyzer
+    g++ -O2 -DNDEBUG -DMAX_AUTO_BLOCKS=256 -Iinclude -Isource source/profiler.cpp source/symbolizer.cpp \
+        source/fleet.cpp -shared -fPIC -std=c++20 -o build/linux-x64-release/profiler_auto.so
+    g++ -O2 -DNDEBUG -DMAX_AUTO_BLOCKS=256 -Iinclude -Isource examples/auto_instrument.cpp -std=c++20 -pthread -rdynamic \
+        -finstrument-functions -finstrument-functions-exclude-file-list=include/,source/ \
+        build/linux-x64-release/profiler_auto.so -Wl,-rpath,'$ORIGIN' \
+        -o build/linux-x64-release/auto_instrument
+    g++ -O2 -DNDEBUG -Iinclude -Isource examples/scope_overhead.cpp -std=c++20 -pthread \
+        build/linux-x64-release/profiler.so -Wl,-rpath,'$ORIGIN' \
+        -o build/linux-x64-release/scope_overhead
+    g++ -O2 -DNDEBUG -DPROFILER_INLINE -Iinclude -Isource examples/scope_overhead.cpp -std=c++20 -pthread \
+        build/linux-x64-release/profiler.so -Wl,-rpath,'$ORIGIN' \
+        -o build/linux-x64-release/scope_overhead_inline
 else
     echo "Unknown build type: $BUILD"
     exit 1
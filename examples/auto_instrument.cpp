@@ -0,0 +1,43 @@
+// Every function in this file is timed without any PROFILE_ macros: it's compiled with
+// -finstrument-functions and linked with -rdynamic so the hooks can name the functions. It and
+// the library it links are both built with MAX_AUTO_BLOCKS, which is 0 by default.
+
+#include "profiler.hpp"
+
+// Recursion is cut off by the depth limit below.
+u64 Fibonacci(u64 n) { return n < 2 ? n : Fibonacci(n - 1) + Fibonacci(n - 2); }
+
+u64 SumSquares(u64 count)
+{
+    u64 result = 0;
+    for (u64 i = 0; i < count; i++)
+        result += i * i;
+    return result;
+}
+
+void Skipped() { SumSquares(1000); }
+
+u64 Work()
+{
+    u64 result = 0;
+    for (u32 i = 0; i < 100; i++)
+    {
+        result += SumSquares(100000);
+        Skipped();
+    }
+    return result + Fibonacci(20);
+}
+
+// Left out: main is still open when PROFILER_END prints the report.
+__attribute__((no_instrument_function)) int main()
+{
+    PROFILER_START();
+    PROFILE_AUTO_EXCLUDE("Skipped");
+    PROFILE_AUTO_DEPTH(8);
+
+    u64 result = Work();
+    INFO("Result %llu", result);
+
+    PROFILER_END();
+    return 0;
+}
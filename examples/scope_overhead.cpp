@@ -0,0 +1,55 @@
+// Cost of an empty PROFILE_SCOPE and PROFILE_STATIC_SCOPE. build.sh builds this twice:
+// scope_overhead calls into profiler.so for every PROFILE_SCOPE, scope_overhead_inline is
+// compiled with -DPROFILER_INLINE. Static scopes are inlined in both.
+
+#include "profiler.hpp"
+
+#define SCOPES 1000000
+
+u64 TimeScopes()
+{
+    u64 best = ~0ull;
+    for (u32 run = 0; run < 10; run++)
+    {
+        u64 from = ReadTimer();
+        for (u32 i = 0; i < SCOPES; i++)
+        {
+            PROFILE_SCOPE("empty");
+        }
+        u64 elapsed = ReadTimer() - from;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best;
+}
+
+u64 TimeStaticScopes()
+{
+    u64 best = ~0ull;
+    for (u32 run = 0; run < 10; run++)
+    {
+        u64 from = ReadTimer();
+        for (u32 i = 0; i < SCOPES; i++)
+        {
+            PROFILE_STATIC_SCOPE("empty static");
+        }
+        u64 elapsed = ReadTimer() - from;
+        best = elapsed < best ? elapsed : best;
+    }
+    return best;
+}
+
+int main()
+{
+    PROFILER_START();
+#ifdef PROFILER_INLINE
+    cstr mode = "inline";
+#else
+    cstr mode = "library";
+#endif
+    Timebase &timebase = Timebase::Get();
+    INFO("PROFILE_SCOPE (%s): %.1f ns per scope", mode, timebase.ToNs(TimeScopes()) / SCOPES);
+    INFO("PROFILE_STATIC_SCOPE: %.1f ns per scope", timebase.ToNs(TimeStaticScopes()) / SCOPES);
+
+    PROFILER_END();
+    return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+// Standard headers go first: types.hpp defines `global`, which collides with libstdc++ internals.
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+#include "types.hpp"
+
+// Shared block stats of a prefork worker pool: a FleetHeader followed by `maxWorkers` slots, each
+// a FleetSlot and `maxBlocks` FleetBlocks. Each worker claims a slot by pid and is its only writer;
+// readers take consistent snapshots through the slot's sequence number, so nothing is ever locked
+// across processes. Slots of exited workers are taken over by later ones, which carry their totals.
+
+#define FLEET_MAGIC "PRFFLEET"
+#define FLEET_VERSION 2
+
+// Attempts at a consistent copy of a slot before it's taken for one whose writer died mid-publish.
+#ifndef FLEET_READ_RETRIES
+#define FLEET_READ_RETRIES 10000
+#endif
+
+#ifndef FLEET_LABEL_LEN
+#define FLEET_LABEL_LEN 64
+#endif
+
+struct FleetHeader
+{
+    char magic[8];
+    u32 version, maxWorkers;
+    std::atomic<u32> workers; // Processes that published so far, including dropped ones
+    u32 owner;                // Process that created the region
+    u32 maxBlocks;            // Per slot, every block the creating build can have
+    std::atomic<u32> dropped; // Workers that found every slot held by a live worker
+};
+
+struct FleetBlock
+{
+    char label[FLEET_LABEL_LEN];
+    u64 iterations, timeEx, timeInc, bytes;
+    u64 violations, worst;
+};
+
+struct FleetSlot
+{
+    std::atomic<u64> sequence; // Odd while the worker writes
+    std::atomic<u32> owner;    // Pid of the worker holding the slot, 0 while free
+    u32 pid, blockCount;
+    u32 workers;    // Published into the slot, the exited ones' totals carried over
+    u64 freq;       // Ticks per second of every time in the slot, as of the last publish
+    u64 start, end; // Ticks, start moved back by the exited workers' run time
+
+    // The header's maxBlocks of them follow the slot.
+    FleetBlock *Blocks() { return (FleetBlock *)(this + 1); }
+};
+
+inline u64 FleetSlotBytes(u32 maxBlocks) { return sizeof(FleetSlot) + u64(maxBlocks) * sizeof(FleetBlock); }
+
+inline u64 FleetBytes(u32 maxWorkers, u32 maxBlocks)
+{
+    return sizeof(FleetHeader) + u64(maxWorkers) * FleetSlotBytes(maxBlocks);
+}
+
+inline FleetSlot *GetFleetSlot(FleetHeader *header, u32 index)
+{
+    return (FleetSlot *)((u8 *)header + sizeof(FleetHeader) + u64(index) * FleetSlotBytes(header->maxBlocks));
+}
+
+enum FleetRead
+{
+    FleetUnpublished,
+    FleetPublished,
+    FleetTorn, // Its worker was killed or exited while publishing
+};
+
+// Copies a slot that may be written concurrently into `out`, which holds FleetSlotBytes(maxBlocks).
+// Gives up after FLEET_READ_RETRIES, so a dead writer can't hang the reader.
+inline FleetRead ReadFleetSlot(FleetSlot *slot, FleetSlot *out, u32 maxBlocks)
+{
+    for (u32 attempt = 0; attempt < FLEET_READ_RETRIES; attempt++)
+    {
+        if (attempt >= 64)
+            std::this_thread::yield();
+
+        u64 before = slot->sequence.load(std::memory_order_acquire);
+        if (before == 0)
+            return FleetUnpublished;
+        if (before & 1)
+            continue;
+
+        memcpy((u8 *)out + offsetof(FleetSlot, pid),
+               (u8 *)slot + offsetof(FleetSlot, pid),
+               FleetSlotBytes(maxBlocks) - offsetof(FleetSlot, pid));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) == before)
+            return FleetPublished;
+    }
+    return FleetTorn;
+}
+
+// Merges every published slot by block label and prints the fleet table, then one line per
+// worker. Defined in fleet.cpp, which both the library and trace_analyzer build.
+void PrintFleetReport(FleetHeader *header);
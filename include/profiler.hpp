@@ -1,5 +1,14 @@
 #pragma once
 
+// Standard headers go first: types.hpp defines `global`, which collides with libstdc++ internals.
+#include <atomic>
+#include <coroutine>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
 #if defined(_WIN32)
 #include "os_win32.hpp"
 #elif defined(__linux__)
@@ -12,6 +21,63 @@
 
 #include "types.hpp"
 #include "containers.hpp"
+#include "trace.hpp"
+#include "fleet.hpp"
+#ifndef MAX_TSC_SKEW_NS
+#define MAX_TSC_SKEW_NS 1000
+#endif
+
+// Clock behind every profiler timestamp, picked once at load and never switched, since
+// timestamps and tick conversions taken before and after a switch wouldn't compare. Uses the CPU
+// timer when it is invariant and the kernel or CPUID reports its frequency, otherwise the OS
+// monotonic clock (or always, built with PROFILER_OS_TIMER). Calibrate (PROFILER_START) then
+// measures the skew between cores, which pins the calling thread to every CPU, and warns when it's
+// too large to trust timestamps compared across threads.
+struct Timebase
+{
+    cstr source;      // Where cpuTimerFreq came from
+    u64 cpuTimerFreq; // Ticks per second of ReadCPUTimer(), whether or not it's in use, 0 if unknown
+    u64 freq;         // Ticks per second of ReadTimer()
+    f64 maxSkewNs;    // Largest CPU timer offset measured between cores
+    bool invariant, useCPUTimer, calibrated;
+
+    static Timebase _Timebase;
+    static Timebase &Get() { return Timebase::_Timebase; }
+    static Timebase Init();
+    // Once per process. Only measures, the clock and freq stay as Init picked them.
+    static void Calibrate();
+
+    f64 ToSeconds(u64 ticks) const { return f64(ticks) / f64(freq); }
+    f64 ToNs(u64 ticks) const { return f64(ticks) * 1e9 / f64(freq); }
+    u64 FromNs(f64 ns) const { return u64(ns * f64(freq) / 1e9 + 0.5); }
+    void Print() const;
+};
+
+#if defined(_MSC_VER)
+#define PROFILER_FORCE_INLINE __forceinline
+#else
+#define PROFILER_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+inline u64 ReadTimer()
+{
+    return Timebase::_Timebase.useCPUTimer ? ReadCPUTimer() : ReadOSTimer();
+}
+
+#ifndef MAX_EXEMPLARS
+#define MAX_EXEMPLARS 4
+#endif
+
+// A single execution of a block, kept if it's among the block's slowest.
+struct Exemplar
+{
+    u64 duration, start, bytes, tag;
+    u32 thread;
+};
+
+#ifndef MAX_NUMA_NODES
+#define MAX_NUMA_NODES 4
+#endif
 
 struct Block
 {
@@ -21,87 +87,1039 @@ struct Block
     u64 iterations;
     u64 from, timeEx, timeInc;
 
+    // Sampled blocks only time some entries. Each timed entry stands for `weight` entries, whose
+    // untimed part was charged to the enclosing block and is tracked in its overcount.
+    u64 samples, weight, entered, overcount;
+
+    // Slowest executions so far, as a min-heap on duration so the fastest is evicted first.
+    u64 activationBytes, tag;
+    Exemplar slowest[MAX_EXEMPLARS];
+    u32 slowestLen;
+
+    // Thread CPU time in ns, only with Profiler::trackCPUTime or for PROFILE_SCOPE_CPU blocks.
+    u64 cpuFrom, cpuEx;
+    bool splitCPU;
+
+    // Only with Profiler::trackPlacement. Exclusive time and bytes are charged to the NUMA node
+    // the block was on when each segment started.
+    u32 entryCPU, node;
+    u64 migrations;
+    u64 nodeTimeEx[MAX_NUMA_NODES], nodeBytes[MAX_NUMA_NODES];
+
     u64 bytesProcessed;
+
+    u64 budget, violations; // Ticks, only for PROFILE_SCOPE_BUDGET
+};
+
+// Blocks that can suspend and resume on another thread. Updated atomically on scope exit.
+struct AsyncBlock
+{
+    cstr label, file;
+    i32 line;
+
+    std::atomic<u64> iterations, wallTime, cpuTime, suspensions, migrations;
 };
 
 #ifndef MAX_BLOCKS
 #define MAX_BLOCKS 64
 #endif
 
+// Ids past MAX_BLOCKS go to functions registered by -finstrument-functions. 0 or a power of two;
+// define it (to 256, say) for the library and the instrumented code alike to opt in.
+#ifndef MAX_AUTO_BLOCKS
+#define MAX_AUTO_BLOCKS 0
+#endif
+
+#define AUTO_BLOCK_SLOTS (MAX_AUTO_BLOCKS ? MAX_AUTO_BLOCKS : 1)
+
+#ifndef MAX_AUTO_FILTERS
+#define MAX_AUTO_FILTERS 8
+#endif
+
+#ifndef AUTO_MAX_DEPTH
+#define AUTO_MAX_DEPTH 16
+#endif
+
+// Log2-bucketed histogram: bucket i counts values in [2^i, 2^(i+1)). Safe to add from any thread.
+struct Histogram
+{
+    std::atomic<u64> buckets[64];
+
+    void Add(u64 value);
+    u64 Count() const;
+    u64 Percentile(f64 p) const;
+};
+
+#ifndef MAX_FLOWS
+#define MAX_FLOWS 16
+#endif
+
+#ifndef PROFILER_ARENA_SIZE
+#define PROFILER_ARENA_SIZE (16ull << 20)
+#endif
+
+#ifndef PROFILER_LARGE_PAGES
+#define PROFILER_LARGE_PAGES 1
+#endif
+
+#ifndef MAX_PENDING_FLOWS
+#define MAX_PENDING_FLOWS 256 // Power of two
+#endif
+
+// Pending flow key of a slot that Begin or End is writing or reading.
+#define FLOW_BUSY ~0ull
+
+// Handoff latency of work items passed between threads, e.g. through a queue. Items in flight
+// are kept in a direct-mapped table indexed by id; an item evicted by a colliding id before
+// its end is counted as dropped.
+struct Flow
+{
+    // Begin and End claim the slot by swapping its key to FLOW_BUSY before touching `from` and
+    // `thread`, so an End never reads the start of a colliding Begin.
+    struct Pending
+    {
+        std::atomic<u64> key; // id + 1, 0 when empty, FLOW_BUSY while claimed
+        std::atomic<u64> from;
+        std::atomic<u32> thread;
+    };
+
+    cstr label;
+    std::atomic<u64> count, crossThread, dropped, total, min, max;
+    Histogram latency;
+    Pending pending[MAX_PENDING_FLOWS];
+
+    void Begin(u64 id);
+    void End(u64 id);
+};
+
+#ifndef MAX_COUNTER_INTERVALS
+#define MAX_COUNTER_INTERVALS 32
+#endif
+
+struct CounterInterval
+{
+    u64 from, count;
+    f64 min, max, last, sum;
+
+    void Add(f64 value);
+};
+
+// Sampled value such as a queue depth or bytes in use. Like blocks, counters are not
+// synchronized: sample each one from a single thread.
+struct Counter
+{
+    cstr label, file;
+    i32 line;
+
+    CounterInterval total, current;
+    CounterInterval history[MAX_COUNTER_INTERVALS]; // Ring of closed intervals
+    u64 intervals;
+};
+
+#ifndef MAX_LOCKS
+#define MAX_LOCKS 32
+#endif
+
+// Times are in OS timer ticks. Hold times are only tracked for exclusive acquisitions.
+struct LockStats
+{
+    cstr label;
+    u64 acquisitions, contended, waitTotal, waitMax, holdTotal, holdMax;
+    u64 sharedAcquisitions, sharedContended, sharedWaitTotal, sharedWaitMax;
+
+    void Merge(const LockStats &other);
+};
+
+// Buffers the profiler allocates at runtime (trace rings, scratch space) come from one
+// reservation that is prefaulted up front, on huge pages where the system has them, so the
+// profiler doesn't page-fault while measuring or add to the page faults RepProfiler reports.
+struct ProfilerArena
+{
+    u8 *base;
+    u64 size;
+    std::atomic<u64> used;
+    std::atomic<bool> reserved;
+    std::atomic<bool> failed; // The last reservation didn't go through, so Alloc won't retry it
+    bool largePages;
+    std::mutex reserveLock;
+
+    static ProfilerArena _Arena;
+    static ProfilerArena &Get() { return ProfilerArena::_Arena; }
+
+    // Happens on the first Alloc with PROFILER_ARENA_SIZE; call it earlier for another size.
+    bool Reserve(u64 bytes);
+    // Zeroed and already faulted in. Falls back to the heap (touching every page) when full, and
+    // returns nullptr when that fails too.
+    void *Alloc(u64 bytes, u64 align = 64);
+};
+
+struct TraceRing
+{
+    TraceEvent *events;
+    u64 mask;
+    std::atomic<u64> head; // Total events written; only the owning thread writes
+    u32 thread;
+    TraceRing *next;
+};
+
+// Keeps the most recent events of every thread in preallocated rings that overwrite themselves,
+// and writes them out only when triggered: by Dump(), SIGUSR2, or a block running longer than
+// `threshold`. Signals and thresholds only raise a flag; the next block end claims it and wakes
+// the recorder's own thread, which writes the dump.
+struct FlightRecorder
+{
+    std::atomic<bool> active, dumpRequested, dumping;
+    u64 ringEvents;  // Per thread, power of two
+    u64 freq;        // Ticks per second of every recorded time, the timebase's at Start
+    u64 window;      // Only dump events this many ticks before the trigger, 0 for the whole ring
+    u64 threshold;   // Dump when a block takes longer than this many ticks, 0 to disable
+    u64 minDumpGap;  // Ticks between two dumps
+    std::atomic<u64> lastDump;
+    cstr path;       // Dumps go to <path>-<pid>-<n>.trace
+    std::atomic<u32> dumps;   // Numbers the generated file names
+    std::atomic<u32> wakeups; // Bumped for every dump handed to `dumper`
+    std::thread dumper;
+    TraceEvent *scratch; // Dump copies rings here, under ringsLock
+    u64 scratchEvents;
+    TraceRing *rings;
+    std::mutex ringsLock;
+
+    void Start(u64 bytesPerThread,
+               f64 windowSeconds = 0,
+               f64 thresholdSeconds = 0,
+               cstr path = "flight");
+    void Stop();
+    void Forked(); // In a forked child, where `dumper` doesn't exist
+    void Record(u32 kind, u32 id, u64 time, u64 value);
+    void RequestDump() { dumpRequested.store(true, std::memory_order_relaxed); }
+    bool Dump(cstr file = nullptr);
+};
+
+struct ProfiledLockBase;
+struct RepProfiler;
+
+// Maps function addresses seen by the -finstrument-functions hooks to block ids, resolving each
+// name once. Filtered out functions are remembered with id 0. Names are resolved outside the
+// lock, so only threads calling the same new function wait for it. Set filters and maxDepth
+// before the first instrumented call: enter and exit must make the same decision.
+struct AutoInstrumentation
+{
+    struct Entry
+    {
+        void *function;
+        u32 id; // AUTO_PENDING while its name is being resolved
+    };
+
+    Entry table[AUTO_BLOCK_SLOTS * 8]; // Open addressing, also holds filtered out functions
+    cstr labels[AUTO_BLOCK_SLOTS], files[AUTO_BLOCK_SLOTS]; // Source file, or module without line tables
+    u32 lines[AUTO_BLOCK_SLOTS];
+    u32 registered;
+    u32 maxDepth; // Instrumented calls nested deeper than this aren't timed
+    StackArray<cstr, MAX_AUTO_FILTERS> include, exclude;
+    std::mutex lock;
+
+    // Substrings of the symbol, module or source file name. With any include filter, only
+    // matching functions are timed; exclude filters win.
+    void Include(cstr pattern) { include.Push(pattern); }
+    void Exclude(cstr pattern) { exclude.Push(pattern); }
+    u32 Resolve(void *function);
+};
+
+#ifndef MAX_BUDGET_QUEUE
+#define MAX_BUDGET_QUEUE 1024 // Power of two
+#endif
+
+// One execution of a PROFILE_SCOPE_BUDGET block that took longer than its budget.
+struct BudgetViolation
+{
+    cstr label, file;
+    i32 line;
+    u32 thread;
+    u64 durationNs, budgetNs;
+    u64 start; // Ticks
+    u64 tag;
+};
+
+typedef void (*BudgetHook)(const BudgetViolation &violation, void *context);
+
+// Bounded multi-producer queue: each slot's sequence number says whether it's free for the
+// producer of that round or holds an item for the consumer. Never blocks; full means dropped.
+struct BudgetQueue
+{
+    struct Slot
+    {
+        std::atomic<u64> sequence;
+        BudgetViolation item;
+    };
+
+    Slot slots[MAX_BUDGET_QUEUE];
+    alignas(64) std::atomic<u64> tail;
+    alignas(64) u64 head; // Only the consumer
+    std::atomic<u64> dropped;
+    std::atomic<bool> sleeping; // The consumer waits on `wakeups`, so Push has to bump it
+    std::atomic<u32> wakeups;
+
+    void Init();
+    bool Push(const BudgetViolation &item);
+    bool Pop(BudgetViolation *item);
+    bool Empty(); // Only the consumer
+    void Wake();
+};
+
+// Counts PROFILE_SCOPE_BUDGET violations in EndBlock. With a hook, violations are queued and a
+// background thread, asleep until one arrives, calls it, so the hook never runs inside the
+// block's thread or holds it up.
+struct LatencyBudgets
+{
+    BudgetHook hook;
+    void *context;
+    BudgetQueue queue;
+    std::thread worker;
+    std::atomic<bool> running;
+
+    void SetHook(BudgetHook hook, void *context = nullptr);
+    void Report(const BudgetViolation &violation);
+    void Stop(); // Calls the hook for what's still queued
+};
+
+// Block stats of prefork worker pools, in memory shared by every process forked after Create.
+// Workers start from empty stats, publish into their own slot on exit() or PROFILER_END (or
+// PROFILER_FLEET_PUBLISH, e.g. before _exit) and skip their own report. Forks that recorded
+// nothing, like fork/exec helpers, never take a slot; respawned workers take over the slots of
+// exited ones and add to their totals. The creating process appends the merged fleet report to
+// its own, so it should wait for its workers first. With a path the region is a file that
+// `trace_analyzer --fleet` can read while the pool runs. Set budget hooks in the workers: the hook
+// thread doesn't survive fork.
+struct ProfilerFleet
+{
+    FleetHeader *header;
+    u64 size;
+    FleetSlot *slot;    // This worker's, claimed on the first publish
+    FleetSlot *carried; // Totals of the exited worker whose slot it took over, or null
+    bool claimed;
+
+    bool Create(u32 maxWorkers, cstr path = nullptr);
+    bool IsWorker() { return header && GetProcessID() != header->owner; }
+    void Publish();
+};
+
+// Per-site, per-thread sampling state for PROFILE_SCOPE_SAMPLED. Unsampled entries only
+// decrement the countdown. Fixed sites time every rate-th entry; randomized sites draw each gap
+// uniformly from [1, 2 * rate - 1], so periodic callers can't alias with the rate.
+struct SampleSite
+{
+    u32 rate, countdown, skipped;
+    bool randomized;
+
+    bool Tick()
+    {
+        skipped++;
+        return --countdown == 0;
+    }
+
+    u32 NextGap();
+};
+
 struct Profiler
 {
     struct BlockFlag
+    {
+        Profiler *parent; // Null for unsampled entries
+        ~BlockFlag()
+        {
+            if (parent)
+                parent->EndBlock();
+        }
+    };
+
+    struct InlineBlockFlag
     {
         Profiler *parent;
-        ~BlockFlag() { parent->EndBlock(); }
+        PROFILER_FORCE_INLINE ~InlineBlockFlag() { parent->ExitBlock(); }
     };
 
     cstr name;
     bool ended;
     u64 start;
 
-    StackArray<Block, MAX_BLOCKS> blocks;
+    // Also accumulate thread CPU time for every block, to split wall time into on-CPU and
+    // off-CPU (blocked, waiting on I/O, preempted). The clock read is a syscall on Linux, a few
+    // hundred ns per boundary; PROFILE_SCOPE_CPU splits only the blocks it marks. Set before the
+    // first block.
+    bool trackCPUTime;
+
+    // Also record the CPU and NUMA node at every block boundary, to attribute time and bytes per
+    // node and count blocks that migrated between entry and exit. Set before the first block.
+    bool trackPlacement;
+    u32 numaNodes; // Highest node seen + 1
+
+    StackArray<Block, MAX_BLOCKS + MAX_AUTO_BLOCKS> blocks;
     StackArray<u64, MAX_BLOCKS> queue;
+    StackArray<AsyncBlock, MAX_BLOCKS> asyncBlocks;
+    StackArray<Counter, MAX_BLOCKS> counters;
+    u64 counterInterval; // OS timer ticks per counter interval, 0 to only aggregate the whole run
+    StackArray<Flow, MAX_FLOWS> flows;
+    std::mutex flowsLock;
+    ProfiledLockBase *liveLocks;
+    StackArray<LockStats, MAX_LOCKS> retiredLocks; // Stats of destroyed locks, merged by label
+    std::mutex locksLock;
+
+    FlightRecorder recorder;
+    AutoInstrumentation autoBlocks;
+    LatencyBudgets budgets;
+    ProfilerFleet fleet;
+    RepProfiler *activeRep; // Receives every block that ends while one of its reps runs
 
     static Profiler _Profiler;
     static bool Initialized; // Prevents destructor from being called on init <.<
     static Profiler &Get() { return Profiler::_Profiler; }
 
     Profiler(cstr _name = "");
-    void BeginBlock(u64 id, cstr label = "", cstr file = "", i32 line = 0, u64 bytesProcessed = 0);
+    void BeginBlock(u64 id,
+                    cstr label = "",
+                    cstr file = "",
+                    i32 line = 0,
+                    u64 bytesProcessed = 0,
+                    u64 weight = 1);
     void AddBytes(u64 bytes);
+    void SetTag(u64 tag);
+    void SetCounter(u64 id, cstr label, f64 value, cstr file = "", i32 line = 0);
     BlockFlag
     BeginScopeBlock(i32 id, cstr label, cstr file = "", i32 line = 0, u64 bytesProcessed = 0);
+    BlockFlag BeginBudgetScopeBlock(
+        i32 id, cstr label, u64 budgetNs, cstr file = "", i32 line = 0, u64 bytesProcessed = 0);
+    BlockFlag BeginCPUScopeBlock(i32 id, cstr label, cstr file = "", i32 line = 0, u64 bytesProcessed = 0);
+    BlockFlag BeginSampledScopeBlock(SampleSite &site,
+                                     i32 id,
+                                     cstr label,
+                                     cstr file = "",
+                                     i32 line = 0,
+                                     u64 bytesProcessed = 0);
     void EndBlock();
+
+    // Bodies of BeginBlock and EndBlock, inlined at the call site in PROFILER_INLINE builds.
+    // FinishBlock holds what only some executions need.
+    PROFILER_FORCE_INLINE void
+    EnterBlock(u64 id, cstr label, cstr file, i32 line, u64 bytesProcessed = 0, u64 weight = 1);
+    PROFILER_FORCE_INLINE void ExitBlock();
+    PROFILER_FORCE_INLINE InlineBlockFlag BeginInlineScopeBlock(i32 id, cstr label, cstr file, i32 line)
+    {
+        EnterBlock(id, label, file, line);
+        return InlineBlockFlag{.parent = this};
+    }
+    PROFILER_FORCE_INLINE void StartBlock(Block *m, u64 id, u64 bytesProcessed, u64 weight);
+    void FinishBlock(Block *m, u64 id, u64 now);
+
+    // PROFILE_STATIC_SCOPE: metadata is written once by RegisterSite, and entries only index the
+    // block with a constant.
+    void RegisterSite(u64 id, cstr label, cstr file, i32 line)
+    {
+        blocks.data[id].label = label;
+        blocks.data[id].file = file;
+        blocks.data[id].line = line;
+    }
+    template <u64 Id>
+    PROFILER_FORCE_INLINE void EnterStaticBlock()
+    {
+        StartBlock(&blocks.data[Id], Id, 0, 1);
+    }
+
+    u32 ReadPlacement(u32 *node);
+    Flow *GetFlow(cstr label);
+    void Start();
     void End();
     ~Profiler();
 };
 
+void Profiler::EnterBlock(u64 id, cstr label, cstr file, i32 line, u64 bytesProcessed, u64 weight)
+{
+    if (id >= blocks.cap)
+    {
+        return;
+    }
+
+    Block *m = &blocks.data[id];
+    m->label = label;
+    m->file = file;
+    m->line = line;
+    StartBlock(m, id, bytesProcessed, weight);
+}
+
+// Ids on the queue were checked on entry, so blocks are indexed directly from here on.
+void Profiler::StartBlock(Block *m, u64 id, u64 bytesProcessed, u64 weight)
+{
+    // The CPU clock is only read at the boundaries of blocks that split CPU time.
+    Block *prev = queue.len > 0 ? &blocks.data[queue.Last()] : nullptr;
+    bool prevCPU = prev && (trackCPUTime || prev->splitCPU);
+
+    u64 time = ReadTimer();
+    u64 cpu = prevCPU || trackCPUTime || m->splitCPU ? ReadThreadCPUTime() : 0;
+    u32 node = 0;
+    u32 processor = trackPlacement ? ReadPlacement(&node) : 0;
+
+    if (recorder.active.load(std::memory_order_relaxed))
+        recorder.Record(TraceBegin, u32(id), time, 0);
+
+    if (prev)
+    {
+        prev->timeEx += time - prev->from;
+        prev->timeInc += time - prev->from;
+        if (prevCPU)
+            prev->cpuEx += cpu - prev->cpuFrom;
+        prev->nodeTimeEx[prev->node] += time - prev->from;
+    }
+
+    m->from = time;
+    m->entered = time;
+    m->weight = weight;
+    m->cpuFrom = cpu;
+    m->entryCPU = processor;
+    m->node = node;
+    m->bytesProcessed += bytesProcessed;
+    m->nodeBytes[node] += bytesProcessed;
+    m->activationBytes = bytesProcessed;
+    m->tag = 0;
+
+    queue.Push(id);
+
+    m->iterations += weight;
+    m->samples++;
+}
+
+void Profiler::ExitBlock()
+{
+    u64 id = queue.Pop();
+    Block *m = &blocks.data[id];
+    Block *prev = queue.len > 0 ? &blocks.data[queue.Last()] : nullptr;
+    bool mCPU = trackCPUTime || m->splitCPU;
+
+    u32 node = 0;
+    u32 processor = trackPlacement ? ReadPlacement(&node) : 0;
+    u64 cpu = mCPU || (prev && prev->splitCPU) ? ReadThreadCPUTime() : 0;
+    u64 now = ReadTimer();
+
+    m->timeEx += now - m->from;
+    m->timeInc += now - m->from;
+    if (mCPU)
+        m->cpuEx += cpu - m->cpuFrom;
+    m->nodeTimeEx[m->node] += now - m->from;
+    if (processor != m->entryCPU)
+        m->migrations++;
+
+    // Most executions are neither among the slowest nor watched by anything.
+    u64 duration = now - m->entered;
+    if (m->slowestLen < MAX_EXEMPLARS || duration > m->slowest[0].duration || m->budget || activeRep ||
+        recorder.active.load(std::memory_order_relaxed))
+        FinishBlock(m, id, now);
+
+    if (prev)
+    {
+        prev->overcount += (m->weight - 1) * duration;
+        prev->from = now;
+        prev->cpuFrom = cpu;
+        prev->node = node;
+        prev->timeInc += now - m->from;
+    }
+}
+
+// Scope of one PROFILE_STATIC_SCOPE site. `Site` is a local struct whose static constexpr
+// functions Id(), Label(), File() and Line() describe it. The site registers on its first entry,
+// not during static initialization, where it could run before the profiler's constructor clears
+// the blocks. The scope holds no state, so an entry compiles to the label check, the timer read
+// and the updates of a block at a fixed address.
+template <typename Site>
+struct StaticScope
+{
+    static_assert(Site::Id() < MAX_BLOCKS, "Raise MAX_BLOCKS");
+
+    PROFILER_FORCE_INLINE StaticScope()
+    {
+        Profiler &profiler = Profiler::_Profiler;
+        if (!profiler.blocks.data[Site::Id()].label)
+            profiler.RegisterSite(Site::Id(), Site::Label(), Site::File(), Site::Line());
+        profiler.EnterStaticBlock<Site::Id()>();
+    }
+    PROFILER_FORCE_INLINE ~StaticScope() { Profiler::_Profiler.ExitBlock(); }
+    StaticScope(const StaticScope &) = delete;
+    StaticScope &operator=(const StaticScope &) = delete;
+};
+
+// Declared as a local inside a coroutine, so its state lives in the coroutine frame instead of
+// the profiler's block queue. Wall time runs from construction to destruction; with
+// Profiler::trackCPUTime, CPU time only accumulates between resumptions, on whichever thread is
+// running the coroutine.
+struct AsyncScope
+{
+    AsyncBlock *block;
+    u64 wallFrom, cpuFrom, cpuPaused, cpuTime, suspensions, migrations;
+    u32 thread;
+    bool suspended, trackCPUTime;
+
+    AsyncScope(u64 id, cstr label, cstr file = "", i32 line = 0);
+    AsyncScope(const AsyncScope &) = delete;
+    AsyncScope &operator=(const AsyncScope &) = delete;
+    void Suspend();
+    void Resume();
+    void Continue();
+    ~AsyncScope();
+};
+
+// Wraps an awaiter so the enclosing AsyncScope sees its suspension points. Only plain awaiters
+// are supported; apply operator co_await / await_transform before wrapping.
+template <typename Awaiter>
+struct ProfiledAwaiter
+{
+    AsyncScope *scope;
+    Awaiter awaiter;
+
+    bool await_ready() { return awaiter.await_ready(); }
+
+    // The coroutine may be resumed (or destroyed) on another thread before the inner
+    // await_suspend returns, so the scope must not be touched after calling it. The exception
+    // is a bool await_suspend returning false: the coroutine never left this thread.
+    template <typename Promise>
+    decltype(auto) await_suspend(std::coroutine_handle<Promise> handle)
+    {
+        scope->Suspend();
+        if constexpr (std::is_same_v<decltype(awaiter.await_suspend(handle)), bool>)
+        {
+            AsyncScope *self = scope;
+            bool suspends = awaiter.await_suspend(handle);
+            if (!suspends)
+                self->Continue();
+            return suspends;
+        }
+        else
+        {
+            return awaiter.await_suspend(handle);
+        }
+    }
+
+    decltype(auto) await_resume()
+    {
+        scope->Resume();
+        return awaiter.await_resume();
+    }
+};
+
+template <typename Awaiter>
+ProfiledAwaiter<Awaiter> ProfileAwait(AsyncScope &scope, Awaiter &&awaiter)
+{
+    return ProfiledAwaiter<Awaiter>{&scope, std::forward<Awaiter>(awaiter)};
+}
+
+// Exclusive counters live in the lock instance and are only written by the current holder, so
+// the uncontended path touches no shared state beyond the lock itself. Instances register with
+// the profiler on first acquisition and fold their counters into it when destroyed.
+struct ProfiledLockBase
+{
+    LockStats stats;
+    u64 acquired;
+    std::atomic<u64> sharedAcquisitions, sharedContended, sharedWaitTotal, sharedWaitMax;
+    std::atomic<bool> registered;
+    ProfiledLockBase *prev, *next;
+
+    ProfiledLockBase(cstr label);
+    ProfiledLockBase(const ProfiledLockBase &) = delete;
+    ProfiledLockBase &operator=(const ProfiledLockBase &) = delete;
+    ~ProfiledLockBase();
+
+    void Register();
+    LockStats Snapshot() const;
+    void SharedAcquired(u64 wait, bool contended);
+
+    void Acquired(u64 now, u64 wait, bool contended)
+    {
+        if (!registered.load(std::memory_order_relaxed))
+            Register();
+
+        acquired = now;
+        stats.acquisitions++;
+        if (contended)
+        {
+            stats.contended++;
+            stats.waitTotal += wait;
+            if (wait > stats.waitMax)
+                stats.waitMax = wait;
+        }
+    }
+
+    void Released(u64 now)
+    {
+        u64 held = now - acquired;
+        stats.holdTotal += held;
+        if (held > stats.holdMax)
+            stats.holdMax = held;
+    }
+};
+
+struct Spinlock
+{
+    std::atomic<bool> locked{false};
+
+    void lock();
+    bool try_lock()
+    {
+        return !locked.load(std::memory_order_relaxed) &&
+               !locked.exchange(true, std::memory_order_acquire);
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+// Drop-in replacement for std::mutex, std::shared_mutex or Spinlock. Works with lock_guard,
+// unique_lock and shared_lock. An uncontended lock()/unlock() pair costs one timer read each.
+template <typename Mutex>
+struct ProfiledMutex : ProfiledLockBase
+{
+    Mutex mutex;
+
+    ProfiledMutex(cstr label) : ProfiledLockBase(label) {}
+
+    void lock()
+    {
+        if (mutex.try_lock())
+        {
+            Acquired(ReadTimer(), 0, false);
+            return;
+        }
+
+        u64 from = ReadTimer();
+        mutex.lock();
+        u64 now = ReadTimer();
+        Acquired(now, now - from, true);
+    }
+
+    bool try_lock()
+    {
+        if (!mutex.try_lock())
+            return false;
+
+        Acquired(ReadTimer(), 0, false);
+        return true;
+    }
+
+    void unlock()
+    {
+        Released(ReadTimer());
+        mutex.unlock();
+    }
+
+    void lock_shared()
+        requires requires(Mutex m) { m.lock_shared(); }
+    {
+        if (mutex.try_lock_shared())
+        {
+            SharedAcquired(0, false);
+            return;
+        }
+
+        u64 from = ReadTimer();
+        mutex.lock_shared();
+        SharedAcquired(ReadTimer() - from, true);
+    }
+
+    bool try_lock_shared()
+        requires requires(Mutex m) { m.try_lock_shared(); }
+    {
+        if (!mutex.try_lock_shared())
+            return false;
+
+        SharedAcquired(0, false);
+        return true;
+    }
+
+    void unlock_shared()
+        requires requires(Mutex m) { m.unlock_shared(); }
+    {
+        mutex.unlock_shared();
+    }
+};
+
+using ProfiledStdMutex = ProfiledMutex<std::mutex>;
+using ProfiledSharedMutex = ProfiledMutex<std::shared_mutex>;
+using ProfiledSpinlock = ProfiledMutex<Spinlock>;
+
+#ifndef NOISE_GAP_NS
+#define NOISE_GAP_NS 2000
+#endif
+
+#ifndef MAX_REP_WORKING_SET
+#define MAX_REP_WORKING_SET 8
+#endif
+
 struct RepBlock
 {
     u64 time, bytes, pageFaults;
+    u64 cycles, instructions;
+};
+
+struct RepStats
+{
+    RepBlock first, min, max, total;
+    u64 count;
+
+    void Add(const RepBlock &rep);
+};
+
+// What happens before a cold rep. Cold and warm reps alternate, so both are measured under the
+// same conditions, and the report shows them side by side.
+enum RepCacheMode
+{
+    RepCacheWarm,    // Back to back reps only
+    RepCacheFlush,   // clflush the working set, or evict the LLC when none was given
+    RepCacheEvict,   // Stream through a buffer twice the size of the last level cache
+    RepCacheRefault, // Drop the working set's pages so they fault again; contents are lost
+};
+
+struct RepBuffer
+{
+    void *data;
+    u64 size;
+};
+
+#ifndef MAX_REP_THREADS
+#define MAX_REP_THREADS 64
+#endif
+
+#ifndef MAX_REP_INNER_BLOCKS
+#define MAX_REP_INNER_BLOCKS 16
+#endif
+
+#ifndef MAX_REP_MATRIX_REPS
+#define MAX_REP_MATRIX_REPS 16384
+#endif
+
+// Time of every profiler block inside each rep, one row per rep from `first`, the first rep with
+// an inner block. Column 0 is the rep itself, column i + 1 is ids[i]. Blocks add to `staged`, and
+// EndRep commits it once the rep's timer has stopped, reserving the rows on the first commit.
+// Reps past MAX_REP_MATRIX_REPS are only in the totals.
+struct RepMatrix
+{
+    u64 *cells;
+    u64 first, rows, columns;
+    u64 staged[MAX_REP_INNER_BLOCKS + 1];
+    StackArray<u64, MAX_REP_INNER_BLOCKS> ids;
+    bool failed; // Couldn't reserve the rows, so don't try again
+
+    u64 *Row(u64 rep) { return cells + (rep - first) * columns; }
+    u64 Recorded(u64 repeats) { return !cells ? 0 : repeats - first < rows ? repeats - first : rows; }
+    void Add(u64 id, u64 duration);
+    void Commit(u64 rep, u64 time, u64 maxRepeats);
+};
+
+// Returns the bytes thread `thread` of `threads` processed in one rep.
+typedef u64 (*RepKernel)(void *context, u32 thread, u32 threads);
+
+#ifndef MAX_REP_VARIANTS
+#define MAX_REP_VARIANTS 8
+#endif
+
+// One implementation in a REPETITION_COMPARE. The body returns the bytes it processed, or
+// nothing; it's taken by reference, so name the lambda before the comparison.
+struct RepVariant
+{
+    cstr label;
+    u64 (*body)(void *context);
+    void *context;
+
+    template <typename Body>
+    static RepVariant Of(cstr label, Body &body)
+    {
+        return RepVariant{
+            .label = label,
+            .body = [](void *context) -> u64
+            {
+                if constexpr (std::is_void_v<decltype((*(Body *)context)())>)
+                {
+                    (*(Body *)context)();
+                    return 0;
+                }
+                else
+                {
+                    return u64((*(Body *)context)());
+                }
+            },
+            .context = &body,
+        };
+    }
+};
+
+// One thread count of a parallel sweep. Each rep runs from the first thread's start to the
+// last thread's finish, with bytes summed over threads.
+struct RepScaling
+{
+    u32 threads;
+    RepStats stats;
 };
 
 struct RepProfiler
 {
     cstr name;
-    RepBlock first, min, max, avg, current;
+    RepStats warm, cold;
+    RepBlock current;
     u64 repeats, maxRepeats;
+    PerfCounters counters; // Cycles and instructions per rep, when the kernel allows it
+    RepCacheMode cacheMode;
+    StackArray<RepBuffer, MAX_REP_WORKING_SET> workingSet;
+    RepMatrix inner; // PROFILE_SCOPE blocks in the rep body, reported per rep
 
-    static RepProfiler New(cstr name, u64 maxRepeats = 100);
+    static RepProfiler New(cstr name, u64 maxRepeats = 100, RepCacheMode cacheMode = RepCacheWarm);
+    // Registers memory the kernel touches, for RepCacheFlush and RepCacheRefault. Takes effect
+    // from the next rep; registering the same buffer again only updates its size.
+    void AddWorkingSet(void *data, u64 size);
     void BeginRep();
     void AddBytes(u64 bytes);
     void EndRep();
     ~RepProfiler();
+
+    // Runs `kernel(thread, threads)` `repeats` times on 1, 2, 4, ... up to `maxThreads` threads
+    // started together by a barrier, and reports aggregate and per-thread bandwidth and parallel
+    // efficiency. Threads are pinned to consecutive CPUs after REPETITION_SETUP pinned one.
+    template <typename Kernel>
+    static void Parallel(cstr name, u64 repeats, u32 maxThreads, Kernel kernel)
+    {
+        RunParallel(
+            name,
+            repeats,
+            maxThreads,
+            [](void *context, u32 thread, u32 threads) -> u64
+            { return (*(Kernel *)context)(thread, threads); },
+            &kernel);
+    }
+
+    static void
+    RunParallel(cstr name, u64 repeats, u32 maxThreads, RepKernel kernel, void *context);
+
+    // Runs every variant once per round, in a new random order each round, so drift in
+    // frequency or temperature hits all of them alike. Reports each variant's times and its
+    // speedup over the first one with a 95% confidence interval.
+    static void Compare(cstr name, u64 rounds, RepVariant *variants, u32 count);
 };
 
 #ifndef DISABLE_PROFILER
 
 #define PROFILER_NEW(name) Profiler::New(name)
+// Measures the timebase's cross-core skew, moving the thread across every CPU. Call before the
+// first block.
+#define PROFILER_START() Profiler::Get().Start()
 #define PROFILER_END() Profiler::Get().End()
-#define PROFILE_BLOCK_BEGIN(name) \
-    Profiler::Get().BeginBlock(__COUNTER__ + 1, name, __FILE__, __LINE__)
+// Call before forking the workers; the optional path makes the stats readable by other tools.
+#define PROFILER_FLEET(maxWorkers, ...) Profiler::Get().fleet.Create(maxWorkers, ##__VA_ARGS__)
+#define PROFILER_FLEET_PUBLISH() Profiler::Get().fleet.Publish()
+// With PROFILER_INLINE, plain blocks and scopes are timed and accumulated at the call site
+// instead of calling into the library, which matters for blocks of a few dozen nanoseconds.
+// Sampled and budgeted scopes, and everything else, still go through the library.
+#ifdef PROFILER_INLINE
+#define PROFILER_ENTER_BLOCK Profiler::Get().EnterBlock
+#define PROFILER_EXIT_BLOCK Profiler::Get().ExitBlock
+#define PROFILER_SCOPE_BLOCK Profiler::Get().BeginInlineScopeBlock
+#else
+#define PROFILER_ENTER_BLOCK Profiler::Get().BeginBlock
+#define PROFILER_EXIT_BLOCK Profiler::Get().EndBlock
+#define PROFILER_SCOPE_BLOCK Profiler::Get().BeginScopeBlock
+#endif
+
+#define PROFILE_BLOCK_BEGIN(name) PROFILER_ENTER_BLOCK(__COUNTER__ + 1, name, __FILE__, __LINE__)
 #define PROFILE_ADD_BANDWIDTH(bytes) Profiler::Get().AddBytes(bytes)
-#define PROFILE_BLOCK_END() Profiler::Get().EndBlock()
+#define PROFILE_TAG(tag) Profiler::Get().SetTag(tag)
+#define PROFILE_FLIGHT_START(bytesPerThread, ...) \
+    Profiler::Get().recorder.Start(bytesPerThread, ##__VA_ARGS__)
+#define PROFILE_FLIGHT_DUMP() Profiler::Get().recorder.Dump()
+#define PROFILE_AUTO_INCLUDE(pattern) Profiler::Get().autoBlocks.Include(pattern)
+#define PROFILE_AUTO_EXCLUDE(pattern) Profiler::Get().autoBlocks.Exclude(pattern)
+#define PROFILE_AUTO_DEPTH(depth) Profiler::Get().autoBlocks.maxDepth = depth
+#define PROFILE_COUNTER(name, value) \
+    Profiler::Get().SetCounter(__COUNTER__ + 1, name, f64(value), __FILE__, __LINE__)
+#define PROFILE_BLOCK_END() PROFILER_EXIT_BLOCK()
+// `name` must be a string literal. Always inlined, whether or not PROFILER_INLINE is set.
+#define PROFILE_STATIC_SCOPE(name)                                        \
+    struct _ProfilerSite                                                  \
+    {                                                                     \
+        static constexpr u64 Id() { return __COUNTER__ + 1; }             \
+        static constexpr cstr Label() { return name; }                    \
+        static constexpr cstr File() { return __FILE__; }                 \
+        static constexpr i32 Line() { return __LINE__; }                  \
+    };                                                                    \
+    StaticScope<_ProfilerSite> _profilerFlag
 #define PROFILE_SCOPE(name) \
-    auto _profilerFlag = Profiler::Get().BeginScopeBlock(__COUNTER__ + 1, name, __FILE__, __LINE__)
+    auto _profilerFlag = PROFILER_SCOPE_BLOCK(__COUNTER__ + 1, name, __FILE__, __LINE__)
 #define PROFILE_FUNCTION() \
-    auto _profilerFlag =   \
-        Profiler::Get().BeginScopeBlock(__COUNTER__ + 1, __func__, __FILE__, __LINE__)
-#define PROFILE(name, code)                                                \
-    Profiler::Get().BeginBlock(__COUNTER__ + 1, name, __FILE__, __LINE__); \
-    code;                                                                  \
-    Profiler::Get().EndBlock();
-
-#define REPETITION_PROFILE(name, count)                  \
-    do                                                   \
-    {                                                    \
-        auto _profiler = RepProfiler::New(name, count);  \
-        while (_profiler.repeats < _profiler.maxRepeats) \
-        {                                                \
+    auto _profilerFlag = PROFILER_SCOPE_BLOCK(__COUNTER__ + 1, __func__, __FILE__, __LINE__)
+// Executions longer than `ns` count as violations of the block's latency budget, and go to the
+// PROFILE_BUDGET_HOOK callback if one is set.
+#define PROFILE_SCOPE_BUDGET(name, ns)                          \
+    auto _profilerFlag = Profiler::Get().BeginBudgetScopeBlock( \
+        __COUNTER__ + 1, name, u64(ns), __FILE__, __LINE__)
+// Splits the block's wall time into on-CPU and off-CPU, like Profiler::trackCPUTime for this
+// block alone.
+#define PROFILE_SCOPE_CPU(name) \
+    auto _profilerFlag = Profiler::Get().BeginCPUScopeBlock(__COUNTER__ + 1, name, __FILE__, __LINE__)
+#define PROFILE_BUDGET_HOOK(hook, ...) Profiler::Get().budgets.SetHook(hook, ##__VA_ARGS__)
+// Times one in `rate` entries and scales the report back up. Bytes for the scope go in the
+// optional third argument: PROFILE_ADD_BANDWIDTH inside an unsampled entry would land in the
+// enclosing block.
+#define PROFILE_SCOPE_SAMPLED(name, rate, ...)                                             \
+    persist thread_local SampleSite _profilerSite = {rate, 1, 0, false};                   \
+    auto _profilerFlag =                                                                   \
+        _profilerSite.Tick()                                                               \
+            ? Profiler::Get().BeginSampledScopeBlock(                                      \
+                  _profilerSite, __COUNTER__ + 1, name, __FILE__, __LINE__, ##__VA_ARGS__) \
+            : Profiler::BlockFlag{nullptr}
+#define PROFILE_SCOPE_SAMPLED_RANDOM(name, rate, ...)                                      \
+    persist thread_local SampleSite _profilerSite = {rate, 1, 0, true};                    \
+    auto _profilerFlag =                                                                   \
+        _profilerSite.Tick()                                                               \
+            ? Profiler::Get().BeginSampledScopeBlock(                                      \
+                  _profilerSite, __COUNTER__ + 1, name, __FILE__, __LINE__, ##__VA_ARGS__) \
+            : Profiler::BlockFlag{nullptr}
+#define PROFILE(name, code)                                          \
+    PROFILER_ENTER_BLOCK(__COUNTER__ + 1, name, __FILE__, __LINE__); \
+    code;                                                            \
+    PROFILER_EXIT_BLOCK();
+#define PROFILE_ASYNC_SCOPE(name) \
+    AsyncScope _profilerAsync(__COUNTER__ + 1, name, __FILE__, __LINE__)
+#define PROFILE_AWAIT(awaiter) ProfileAwait(_profilerAsync, awaiter)
+#define PROFILE_FLOW_BEGIN(name, id)                                  \
+    do                                                                \
+    {                                                                 \
+        persist Flow *_profilerFlow = Profiler::Get().GetFlow(name);  \
+        if (_profilerFlow)                                            \
+            _profilerFlow->Begin(id);                                 \
+    } while (0)
+#define PROFILE_FLOW_END(name, id)                                    \
+    do                                                                \
+    {                                                                 \
+        persist Flow *_profilerFlow = Profiler::Get().GetFlow(name);  \
+        if (_profilerFlow)                                            \
+            _profilerFlow->End(id);                                   \
+    } while (0)
+
+// Takes an optional RepCacheMode after the count.
+#define REPETITION_PROFILE(name, count, ...)                           \
+    do                                                                 \
+    {                                                                  \
+        auto _profiler = RepProfiler::New(name, count, ##__VA_ARGS__); \
+        while (_profiler.repeats < _profiler.maxRepeats)               \
+        {                                                              \
             _profiler.BeginRep();
 
 #define REPETITION_BANDWIDTH(bytes) _profiler.AddBytes(bytes)
+#define REPETITION_WORKING_SET(data, size) _profiler.AddWorkingSet(data, size)
+#define REPETITION_PARALLEL(name, count, maxThreads, kernel) \
+    RepProfiler::Parallel(name, count, maxThreads, kernel)
+// REPETITION_COMPARE("sum", 200, REPETITION_VARIANT("scalar", scalar), REPETITION_VARIANT("simd", simd))
+#define REPETITION_VARIANT(label, body) RepVariant::Of(label, body)
+#define REPETITION_COMPARE(name, rounds, ...)                                                  \
+    do                                                                                         \
+    {                                                                                          \
+        RepVariant _variants[] = {__VA_ARGS__};                                                \
+        RepProfiler::Compare(name, rounds, _variants, sizeof(_variants) / sizeof(*_variants)); \
+    } while (0)
+// Pins the calling thread to `cpu` (-1 to leave it), optionally raises its priority, and
+// records the frequency policy and timer noise for the following RepProfiler reports.
+#define REPETITION_SETUP(cpu, raisePriority) SystemInfo::InitBenchmark(cpu, raisePriority)
+// Undoes REPETITION_SETUP on the same thread, or leave it to PROFILER_END.
+#define REPETITION_TEARDOWN() SystemInfo::EndBenchmark()
 
 #define REPETITION_END() \
     _profiler.EndRep();  \
@@ -113,16 +1131,42 @@ struct RepProfiler
 #else
 
 #define PROFILER_NEW(...)
+#define PROFILER_START(...)
 #define PROFILER_END(...)
+#define PROFILER_FLEET(...)
+#define PROFILER_FLEET_PUBLISH(...)
 #define PROFILE_BLOCK_BEGIN(...)
 #define PROFILE_ADD_BANDWIDTH(...)
+#define PROFILE_TAG(...)
+#define PROFILE_FLIGHT_START(...)
+#define PROFILE_FLIGHT_DUMP(...)
+#define PROFILE_AUTO_INCLUDE(...)
+#define PROFILE_AUTO_EXCLUDE(...)
+#define PROFILE_AUTO_DEPTH(...)
+#define PROFILE_COUNTER(...)
 #define PROFILE_BLOCK_END(...)
 #define PROFILE_SCOPE(...)
+#define PROFILE_STATIC_SCOPE(...)
 #define PROFILE_FUNCTION(...)
+#define PROFILE_SCOPE_BUDGET(...)
+#define PROFILE_SCOPE_CPU(...)
+#define PROFILE_BUDGET_HOOK(...)
+#define PROFILE_SCOPE_SAMPLED(...)
+#define PROFILE_SCOPE_SAMPLED_RANDOM(...)
 #define PROFILE(name, code) code
+#define PROFILE_ASYNC_SCOPE(...)
+#define PROFILE_AWAIT(awaiter) awaiter
+#define PROFILE_FLOW_BEGIN(...)
+#define PROFILE_FLOW_END(...)
 
 #define REPETITION_PROFILE(...)
 #define REPETITION_BANDWIDTH(...)
+#define REPETITION_WORKING_SET(...)
+#define REPETITION_SETUP(...)
+#define REPETITION_TEARDOWN()
+#define REPETITION_PARALLEL(...)
+#define REPETITION_VARIANT(...)
+#define REPETITION_COMPARE(...)
 #define REPETITION_END(...)
 
 #endif
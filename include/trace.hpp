@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.hpp"
+
+// Flight recorder trace format: a TraceHeader, a TraceSystem, `names` TraceName records each
+// followed by the label and file characters, then `threads` streams of a TraceThread followed by
+// its events. Version 1 traces have no TraceSystem.
+enum TraceEventKind : u32
+{
+    TraceBegin,     // id: block
+    TraceEnd,       // id: block, value: bytes added during the execution
+    TraceFlowBegin, // id: flow, value: item id
+    TraceFlowEnd,   // id: flow, value: item id
+    TraceCounter,   // id: counter, value: f64 bits
+};
+
+struct TraceEvent
+{
+    u64 time, value;
+    u32 id, kind;
+};
+
+enum TraceNameKind : u32
+{
+    TraceNameBlock,
+    TraceNameFlow,
+    TraceNameCounter,
+};
+
+#define TRACE_MAGIC "PRFTRACE"
+#define TRACE_VERSION 2
+
+struct TraceHeader
+{
+    char magic[8];
+    u32 version, names, threads, pad;
+    u64 freq, start;
+};
+
+// The SystemInfo of the recording machine.
+struct TraceSystem
+{
+    char platform[16], architecture[16];
+    u32 processors, pageSize;
+    u32 majorVersion, minorVersion, buildNumber, pad;
+    u64 cpuTimerFreq, totalPhys;
+};
+
+struct TraceName
+{
+    u32 kind, id, line, labelLen, fileLen;
+};
+
+struct TraceThread
+{
+    u32 thread, pad;
+    u64 events;
+};
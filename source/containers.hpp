@@ -12,10 +12,10 @@ struct Array
     u64 len;
     u64 cap;
 
-    Array<T>() { WARN("Empty array initialized"); }
-    Array<T>(T *_data, u64 _len, u64 _cap) : data{_data}, len{_len}, cap{_cap} {}
+    Array() { WARN("Empty array initialized"); }
+    Array(T *_data, u64 _len, u64 _cap) : data{_data}, len{_len}, cap{_cap} {}
 
-    ~Array<T>() = default;
+    ~Array() = default;
 
     static Array<T> New(u64 size)
     {
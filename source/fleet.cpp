@@ -0,0 +1,151 @@
+// Standard headers go first: types.hpp defines `global`, which collides with libstdc++ internals.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "fleet.hpp"
+
+// Fleet-wide totals per label in ns, with how they spread over workers (min and max are per slot,
+// which also holds the totals of the exited workers it took over).
+struct FleetTotal
+{
+    FleetBlock sum;
+    u32 workers, slowestPid;
+    u64 minEx, maxEx;
+};
+
+// Slots may come from processes on different clocks, so every time is brought to ns first.
+internal void FleetSlotToNs(FleetSlot *slot, u32 maxBlocks)
+{
+    f64 scale = slot->freq ? 1e9 / f64(slot->freq) : 0;
+    slot->end = u64(f64(slot->end - slot->start) * scale);
+    slot->start = 0;
+    for (u32 b = 0; b < slot->blockCount && b < maxBlocks; b++)
+    {
+        FleetBlock &block = slot->Blocks()[b];
+        block.timeEx = u64(f64(block.timeEx) * scale);
+        block.timeInc = u64(f64(block.timeInc) * scale);
+        block.worst = u64(f64(block.worst) * scale);
+    }
+}
+
+void PrintFleetReport(FleetHeader *header)
+{
+    u32 slots = header->maxWorkers;
+    u32 maxBlocks = header->maxBlocks;
+    FleetSlot *slot = (FleetSlot *)malloc(FleetSlotBytes(maxBlocks));
+    FleetTotal *totals = (FleetTotal *)calloc(maxBlocks ? maxBlocks : 1, sizeof(FleetTotal));
+    u32 totalCount = 0, published = 0, torn = 0;
+    for (u32 i = 0; i < slots; i++)
+    {
+        FleetRead read = ReadFleetSlot(GetFleetSlot(header, i), slot, maxBlocks);
+        torn += read == FleetTorn ? 1 : 0;
+        if (read != FleetPublished)
+            continue;
+        published++;
+        FleetSlotToNs(slot, maxBlocks);
+
+        for (u32 b = 0; b < slot->blockCount && b < maxBlocks; b++)
+        {
+            FleetBlock &block = slot->Blocks()[b];
+            u32 t = 0;
+            while (t < totalCount && strcmp(totals[t].sum.label, block.label) != 0)
+                t++;
+            if (t == maxBlocks)
+                continue;
+            if (t == totalCount)
+            {
+                totalCount++;
+                memcpy(totals[t].sum.label, block.label, FLEET_LABEL_LEN);
+                totals[t].minEx = block.timeEx;
+            }
+
+            FleetTotal &total = totals[t];
+            total.sum.iterations += block.iterations;
+            total.sum.timeEx += block.timeEx;
+            total.sum.timeInc += block.timeInc;
+            total.sum.bytes += block.bytes;
+            total.sum.violations += block.violations;
+            total.sum.worst = block.worst > total.sum.worst ? block.worst : total.sum.worst;
+            total.minEx = block.timeEx < total.minEx ? block.timeEx : total.minEx;
+            if (block.timeEx >= total.maxEx)
+            {
+                total.maxEx = block.timeEx;
+                total.slowestPid = slot->pid;
+            }
+            total.workers += slot->workers;
+        }
+    }
+
+    INFO("Fleet: %u workers published into %u of %u slots",
+         header->workers.load(std::memory_order_acquire),
+         published,
+         slots);
+    u32 dropped = header->dropped.load(std::memory_order_relaxed);
+    if (dropped)
+        WARN("%u workers found all %u slots held by live workers and weren't recorded", dropped, slots);
+    if (torn)
+        WARN("Skipped %u slots left half written by workers that died while publishing", torn);
+
+    printf(" %-24s \t| %-12s \t| %-12s \t| %-30s \t| %-12s\n",
+           "Name[n]",
+           "Time (Ex)",
+           "Time (Inc)",
+           "Per worker (Ex) min/avg/max",
+           "Slowest");
+    printf("-----------------------------------------------------------------------------------"
+           "--------------------------------------------\n");
+    for (u32 t = 0; t < totalCount; t++)
+    {
+        FleetTotal &total = totals[t];
+        printf(" %-20s [%llu] \t| %.5f secs \t| %.5f secs \t| %.5f / %.5f / %.5f secs \t| pid %u\n",
+               total.sum.label,
+               total.sum.iterations,
+               f64(total.sum.timeEx) / 1e9,
+               f64(total.sum.timeInc) / 1e9,
+               f64(total.minEx) / 1e9,
+               f64(total.sum.timeEx) / f64(total.workers) / 1e9,
+               f64(total.maxEx) / 1e9,
+               total.slowestPid);
+    }
+
+    INFO("Per worker");
+    printf(" %-10s \t| %-8s \t| %-12s \t| %-12s \t| %-12s \t| %-24s\n",
+           "Pid",
+           "Workers",
+           "Run time",
+           "Executions",
+           "Time (Ex)",
+           "Busiest block");
+    printf("-----------------------------------------------------------------------------------"
+           "-------------------------------------\n");
+    for (u32 i = 0; i < slots; i++)
+    {
+        if (ReadFleetSlot(GetFleetSlot(header, i), slot, maxBlocks) != FleetPublished)
+            continue;
+        FleetSlotToNs(slot, maxBlocks);
+
+        u64 executions = 0, timeEx = 0;
+        FleetBlock *busiest = nullptr;
+        for (u32 b = 0; b < slot->blockCount && b < maxBlocks; b++)
+        {
+            FleetBlock &block = slot->Blocks()[b];
+            executions += block.iterations;
+            timeEx += block.timeEx;
+            busiest = !busiest || block.timeEx > busiest->timeEx ? &block : busiest;
+        }
+
+        f64 runTime = f64(slot->end) / 1e9;
+        printf(" %-10u \t| %-8u \t| %.5f secs \t| %-12llu \t| %.5f secs \t| %s (%.2f%%)\n",
+               slot->pid,
+               slot->workers,
+               runTime,
+               executions,
+               f64(timeEx) / 1e9,
+               busiest ? busiest->label : "-",
+               busiest && runTime > 0 ? 100.0 * f64(busiest->timeEx) / 1e9 / runTime : 0.0);
+    }
+
+    free(totals);
+    free(slot);
+}
@@ -24,10 +24,107 @@ u64 ReadCPUTimer(void);
 
 u64 EstimateCPUTimerFreq(void);
 
+// Monotonic wall clock shared by every thread in the process.
+u64 ReadOSTimer(void);
+u64 GetOSTimerFreq(void);
+
+// CPU time consumed by the calling thread, in nanoseconds.
+u64 ReadThreadCPUTime(void);
+
+u32 GetThreadID(void);
+
+// CPU the calling thread is running on, and that CPU's NUMA node.
+u32 GetCurrentCPU(u32 *node);
+
+// Returns false when CPUID isn't available or the leaf is out of range.
+bool ReadCPUID(u32 leaf, u32 subleaf, u32 regs[4]);
+
+// CPU timer frequency as calibrated by the kernel, or 0 when it doesn't expose one.
+u64 ReadKernelCPUTimerFreq(void);
+
+// Cached frequency of ReadCPUTimer(), see Timebase.
+u64 GetCPUTimerFreq(void);
+
+// Calls `handler` on SIGUSR2. Returns false where there is no such signal.
+bool InstallDumpSignal(void (*handler)(int));
+
+u32 GetProcessID(void);
+
+// False once the process has exited. Processes of other users count as alive.
+bool IsProcessAlive(u32 pid);
+
+// Reserves and commits `size` bytes of zeroed memory with every page already faulted in. With
+// `largePages` it tries huge pages first and falls back to normal pages, setting
+// *gotLargePages accordingly. Returns null on failure. Release with the same size and flag.
+void *ReserveMemory(u64 size, bool largePages, bool *gotLargePages);
+void ReleaseMemory(void *memory, u64 size, bool largePages);
+
+// Zeroed memory visible to every process forked after the call, or to every process mapping the
+// same `path` when one is given (the file is created or resized to `size`). Returns null on
+// failure.
+void *MapSharedMemory(cstr path, u64 size);
+void UnmapSharedMemory(void *memory, u64 size);
+
+// Calls `handler` in the child after every fork(). Returns false where there is no fork.
+bool InstallForkHandler(void (*handler)(void));
+
+// Faults in every page of existing memory, keeping its contents.
+void PrefaultMemory(void *memory, u64 size);
+
+// Writes back and invalidates every cache line of `memory`. Returns false where the CPU has no
+// user mode flush instruction.
+bool FlushCacheLines(void *memory, u64 size);
+
+// Drops the pages of `memory` so the next touch faults again. Contents aren't preserved: Linux
+// hands back zero pages.
+void DiscardMemory(void *memory, u64 size);
+
+// Size of the largest cache level in bytes, or 0 when unknown.
+u64 GetLastLevelCacheSize(void);
+
+// Name of the function containing `address` (demangled where possible) and the module it's in.
+// Only sees exported symbols; link executables with -rdynamic.
+bool ResolveSymbol(void *address, char *name, u64 nameLen, char *module, u64 moduleLen);
+
+bool PinThreadToCPU(u32 cpu);
+void ResetThreadAffinity(void);
+
+// Moves the calling thread above normal work: realtime FIFO on Linux (or the lowest nice value
+// when that isn't permitted), time critical on Windows. Reset restores the previous priority.
+bool RaiseThreadPriority(void);
+void ResetThreadPriority(void);
+
+// Frequency scaling policy of `cpu`: governor name ("" when unknown) and whether turbo is enabled
+// (1), disabled (0) or unknown (-1).
+void ReadFrequencyPolicy(u32 cpu, char *governor, u64 governorLen, i32 *turbo);
+
+// Logical CPUs sharing a physical core with `cpu`, including itself. 0 when unknown.
+u32 CountSMTSiblings(u32 cpu);
+
+// Per-thread hardware counters. Where the kernel allows it they are read in userspace with
+// rdpmc, so a read costs about as much as ReadCPUTimer().
+struct PerfCounters
+{
+    enum Kind
+    {
+        Cycles,
+        Instructions,
+        Count
+    };
+
+    i32 fds[Count];
+    void *pages[Count];
+    bool valid, userspace; // userspace: rdpmc allowed on every counter
+
+    static PerfCounters Open();
+    void Close();
+    void Read(u64 values[Count]);
+};
+
 struct SystemInfo
 {
     // System
-    cstr processorArchitecture;
+    cstr platformName, processorArchitecture;
     u32 numberOfProcessors, pageSize, allocationGranularity;
     f64 cpuFreq;
 
@@ -40,12 +137,33 @@ struct SystemInfo
     // GPU
     cstr gpuName, gpuVendor, glVersion;
 
-    static SystemInfo Init();
+    // Benchmark environment, only filled by InitBenchmark
+    bool benchmark;
+    i32 pinnedCPU; // -1 when the thread wasn't pinned
+    bool raisedPriority;
+    char governor[32];
+    i32 turbo;
+    u32 smtSiblings;
+    u32 interruptions; // Gaps over NOISE_GAP_NS in a busy loop, per second
+    f64 maxGapUs, lostPercent;
+
+    // Query doesn't print.
+    static SystemInfo Query();
+    static SystemInfo Init()
+    {
+        SystemInfo result = Query();
+        result.Print();
+        return result;
+    }
+    static SystemInfo InitBenchmark(i32 cpu, bool raisePriority);
+    // Restores the affinity and priority InitBenchmark changed. Call it on the same thread;
+    // PROFILER_END does too.
+    static void EndBenchmark();
 
     void Print() const
     {
         INFO("System Information");
-        printf("\t> Platform: \t\t\tWindows %s\n", processorArchitecture);
+        printf("\t> Platform: \t\t\t%s %s\n", platformName, processorArchitecture);
         printf("\t> Version: \t\t\t%u.%u.%u\n", majorVersion, minorVersion, buildNumber);
         printf("\t> Processor Count: \t\t%u\n", numberOfProcessors);
         printf("\t> CPU Frequency: \t\t%.2f GHz\n", cpuFreq);
@@ -57,4 +175,21 @@ struct SystemInfo
         printf("\t> Total Virtual Memory: \t%llu MB\n", totalVirtual / (1024 * 1024));
         printf("\t> Available Virtual Memory: \t%llu MB\n", availVirtual / (1024 * 1024));
     }
+
+    void PrintBenchmark() const
+    {
+        INFO("Benchmark Environment");
+        if (pinnedCPU >= 0)
+            printf("\t> Pinned CPU: \t\t\t%d\n", pinnedCPU);
+        else
+            printf("\t> Pinned CPU: \t\t\tnone\n");
+        printf("\t> Raised Priority: \t\t%s\n", raisedPriority ? "yes" : "no");
+        printf("\t> Governor: \t\t\t%s\n", governor[0] ? governor : "unknown");
+        printf("\t> Turbo: \t\t\t%s\n", turbo < 0 ? "unknown" : turbo ? "enabled" : "disabled");
+        printf("\t> SMT Siblings: \t\t%u\n", smtSiblings);
+        printf("\t> Noise: \t\t\t%u interruptions/s, max %.1f us, %.3f%% lost\n",
+               interruptions,
+               maxGapUs,
+               lostPercent);
+    }
 };
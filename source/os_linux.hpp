@@ -0,0 +1,609 @@
+#include "os.hpp"
+
+#include <linux/perf_event.h>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#undef EXPORT
+#define EXPORT extern "C" __attribute__((visibility("default")))
+
+Metrics::Metrics() : initialized{true}, processHandle{nullptr} {}
+
+u64 Metrics::ReadPageFaultCount()
+{
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    u64 result = usage.ru_minflt + usage.ru_majflt;
+    return result;
+}
+
+u64 ReadOSTimer(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000000ull + u64(ts.tv_nsec);
+}
+
+u64 GetOSTimerFreq(void) { return 1000000000ull; }
+
+u64 ReadThreadCPUTime(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return u64(ts.tv_sec) * 1000000000ull + u64(ts.tv_nsec);
+}
+
+u32 GetThreadID(void)
+{
+    persist thread_local u32 tid = 0;
+    if (tid == 0)
+        tid = u32(syscall(SYS_gettid));
+    return tid;
+}
+
+bool ReadCPUID(u32 leaf, u32 subleaf, u32 regs[4])
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]) != 0;
+#else
+    return false;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+global bool hasRDTSCP = []
+{
+    u32 regs[4];
+    return ReadCPUID(0x80000001, 0, regs) && (regs[3] & (1u << 27));
+}();
+#endif
+
+u32 GetCurrentCPU(u32 *node)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // Linux keeps (node << 12) | cpu in TSC_AUX, so this needs no syscall.
+    if (hasRDTSCP)
+    {
+        u32 aux;
+        __rdtscp(&aux);
+        *node = aux >> 12;
+        return aux & 0xfff;
+    }
+#endif
+
+    unsigned int cpu = 0, numaNode = 0;
+    getcpu(&cpu, &numaNode);
+    *node = numaNode;
+    return cpu;
+}
+
+u64 ReadKernelCPUTimerFreq(void)
+{
+    // Exposed by some kernels and the tsc_freq_khz module.
+    FILE *file = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+    if (file)
+    {
+        u64 khz = 0;
+        i32 read = fscanf(file, "%lu", &khz);
+        fclose(file);
+        if (read == 1 && khz)
+            return khz * 1000;
+    }
+
+    // Otherwise derive it from the TSC -> ns conversion the kernel publishes in the perf mmap page.
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_DUMMY;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    i32 fd = i32(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    if (fd < 0)
+        return 0;
+
+    u64 result = 0;
+    u64 pageSize = u64(sysconf(_SC_PAGESIZE));
+    void *page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (page != MAP_FAILED)
+    {
+        auto *info = (perf_event_mmap_page *)page;
+        if (info->cap_user_time && info->time_mult)
+            result = u64((__uint128_t(1000000000ull) << info->time_shift) / info->time_mult);
+        munmap(page, pageSize);
+    }
+
+    close(fd);
+    return result;
+}
+
+u32 GetProcessID(void) { return u32(getpid()); }
+
+bool IsProcessAlive(u32 pid) { return kill(pid_t(pid), 0) == 0 || errno == EPERM; }
+
+bool InstallDumpSignal(void (*handler)(int))
+{
+    struct sigaction action = {};
+    action.sa_handler = handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGUSR2, &action, nullptr) == 0;
+}
+
+#define HUGE_PAGE_SIZE (2ull << 20)
+
+// MAP_HUGETLB needs pages reserved in /proc/sys/vm/nr_hugepages. Without them we fall back to
+// transparent huge pages, which the kernel may or may not grant, so *gotLargePages is only set
+// for the former.
+void *ReserveMemory(u64 size, bool largePages, bool *gotLargePages)
+{
+    *gotLargePages = false;
+    if (largePages)
+    {
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *memory = mmap(nullptr,
+                            size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                            -1,
+                            0);
+        if (memory != MAP_FAILED)
+        {
+            *gotLargePages = true;
+            return memory;
+        }
+    }
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+
+#ifdef MADV_HUGEPAGE
+    if (largePages)
+        madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    PrefaultMemory(memory, size);
+    return memory;
+}
+
+void ReleaseMemory(void *memory, u64 size, bool largePages)
+{
+    if (largePages)
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    munmap(memory, size);
+}
+
+void *MapSharedMemory(cstr path, u64 size)
+{
+    if (!path)
+    {
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    i32 fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return nullptr;
+
+    void *memory = MAP_FAILED;
+    if (ftruncate(fd, off_t(size)) == 0)
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return memory == MAP_FAILED ? nullptr : memory;
+}
+
+void UnmapSharedMemory(void *memory, u64 size) { munmap(memory, size); }
+
+bool InstallForkHandler(void (*handler)(void)) { return pthread_atfork(nullptr, nullptr, handler) == 0; }
+
+void PrefaultMemory(void *memory, u64 size)
+{
+    u64 pageSize = u64(sysconf(_SC_PAGESIZE));
+
+#ifdef MADV_POPULATE_WRITE
+    // One syscall instead of a fault per page, on kernels since 5.14. Needs page alignment.
+    u64 from = (u64(memory) + pageSize - 1) & ~(pageSize - 1);
+    u64 to = (u64(memory) + size) & ~(pageSize - 1);
+    if (to > from)
+        madvise((void *)from, to - from, MADV_POPULATE_WRITE);
+#endif
+
+    // Writing the value back keeps the contents and forces a private copy of zero pages.
+    volatile u8 *bytes = (volatile u8 *)memory;
+    for (u64 at = 0; at < size; at += pageSize)
+        bytes[at] = bytes[at];
+    if (size)
+        bytes[size - 1] = bytes[size - 1];
+}
+
+bool FlushCacheLines(void *memory, u64 size)
+{
+    u8 *from = (u8 *)(u64(memory) & ~63ull);
+    u8 *to = (u8 *)memory + size;
+
+#if defined(__x86_64__) || defined(__i386__)
+    for (u8 *line = from; line < to; line += 64)
+        _mm_clflush(line);
+    _mm_mfence();
+    return true;
+
+#elif defined(__aarch64__)
+    for (u8 *line = from; line < to; line += 64)
+        __asm__ volatile("dc civac, %0" ::"r"(line) : "memory");
+    __asm__ volatile("dsb ish" ::: "memory");
+    return true;
+
+#else
+    return false;
+#endif
+}
+
+void DiscardMemory(void *memory, u64 size)
+{
+    // Only whole pages can be dropped.
+    u64 pageSize = u64(sysconf(_SC_PAGESIZE));
+    u64 from = (u64(memory) + pageSize - 1) & ~(pageSize - 1);
+    u64 to = (u64(memory) + size) & ~(pageSize - 1);
+    if (to > from)
+        madvise((void *)from, to - from, MADV_DONTNEED);
+}
+
+u64 GetLastLevelCacheSize(void)
+{
+    i32 levels[] = {_SC_LEVEL4_CACHE_SIZE, _SC_LEVEL3_CACHE_SIZE, _SC_LEVEL2_CACHE_SIZE};
+    for (i32 level : levels)
+    {
+        long size = sysconf(level);
+        if (size > 0)
+            return u64(size);
+    }
+
+    return 0;
+}
+
+bool ResolveSymbol(void *address, char *name, u64 nameLen, char *module, u64 moduleLen)
+{
+    Dl_info info;
+    if (!dladdr(address, &info))
+        return false;
+
+    snprintf(module, moduleLen, "%s", info.dli_fname ? info.dli_fname : "");
+    if (!info.dli_sname)
+        return false;
+
+    i32 status = 0;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    snprintf(name, nameLen, "%s", status == 0 && demangled ? demangled : info.dli_sname);
+    free(demangled);
+    return true;
+}
+
+// Mask the thread had before its first PinThreadToCPU, restored by ResetThreadAffinity.
+persist thread_local cpu_set_t savedAffinity;
+persist thread_local bool hasSavedAffinity = false;
+
+bool PinThreadToCPU(u32 cpu)
+{
+    if (cpu >= CPU_SETSIZE)
+        return false;
+
+    if (!hasSavedAffinity)
+        hasSavedAffinity = sched_getaffinity(0, sizeof(savedAffinity), &savedAffinity) == 0;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+void ResetThreadAffinity(void)
+{
+    if (!hasSavedAffinity)
+        return;
+
+    sched_setaffinity(0, sizeof(savedAffinity), &savedAffinity);
+    hasSavedAffinity = false;
+}
+
+persist thread_local bool hasSavedPriority = false;
+persist thread_local i32 savedPolicy, savedNice;
+persist thread_local sched_param savedParam;
+
+bool RaiseThreadPriority(void)
+{
+    if (!hasSavedPriority)
+    {
+        savedPolicy = sched_getscheduler(0);
+        sched_getparam(0, &savedParam);
+        errno = 0;
+        savedNice = getpriority(PRIO_PROCESS, 0);
+        hasSavedPriority = true;
+    }
+
+    // The lowest realtime priority is still above every normal thread, and leaves room for the
+    // kernel's own realtime threads.
+    sched_param param = {};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == 0)
+        return true;
+
+    return setpriority(PRIO_PROCESS, 0, -20) == 0;
+}
+
+void ResetThreadPriority(void)
+{
+    if (!hasSavedPriority)
+        return;
+
+    sched_setscheduler(0, savedPolicy, &savedParam);
+    setpriority(PRIO_PROCESS, 0, savedNice);
+    hasSavedPriority = false;
+}
+
+internal bool ReadSysfsLine(cstr path, char *out, u64 len)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    bool result = fgets(out, i32(len), file) != nullptr;
+    fclose(file);
+    if (result)
+        out[strcspn(out, "\n")] = 0;
+    return result;
+}
+
+void ReadFrequencyPolicy(u32 cpu, char *governor, u64 governorLen, i32 *turbo)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cpufreq/scaling_governor", cpu);
+    if (!ReadSysfsLine(path, governor, governorLen))
+        governor[0] = 0;
+
+    // intel_pstate reports the inverse; acpi-cpufreq and amd-pstate use the generic boost file.
+    char value[16];
+    *turbo = -1;
+    if (ReadSysfsLine("/sys/devices/system/cpu/intel_pstate/no_turbo", value, sizeof(value)))
+        *turbo = atoi(value) ? 0 : 1;
+    else if (ReadSysfsLine("/sys/devices/system/cpu/cpufreq/boost", value, sizeof(value)))
+        *turbo = atoi(value) ? 1 : 0;
+}
+
+u32 CountSMTSiblings(u32 cpu)
+{
+    char path[128], list[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+    if (!ReadSysfsLine(path, list, sizeof(list)))
+        return 0;
+
+    // Comma separated CPUs and ranges, e.g. "0,64" or "0-1".
+    u32 result = 0;
+    for (char *at = list; *at;)
+    {
+        char *end;
+        u32 from = u32(strtoul(at, &end, 10));
+        u32 to = from;
+        if (*end == '-')
+            to = u32(strtoul(end + 1, &end, 10));
+        result += to >= from ? to - from + 1 : 0;
+        at = *end ? end + 1 : end;
+    }
+
+    return result;
+}
+
+u64 EstimateCPUTimerFreq(void)
+{
+    u64 MillisecondsToWait = 100;
+
+    u64 OSFreq = GetOSTimerFreq();
+
+    u64 CPUStart = ReadCPUTimer();
+    u64 OSStart = ReadOSTimer();
+    u64 OSElapsed = 0;
+    u64 OSWaitTime = OSFreq * MillisecondsToWait / 1000;
+    while (OSElapsed < OSWaitTime)
+    {
+        OSElapsed = ReadOSTimer() - OSStart;
+    }
+
+    u64 CPUEnd = ReadCPUTimer();
+    u64 CPUElapsed = CPUEnd - CPUStart;
+
+    u64 CPUFreq = 0;
+    if (OSElapsed)
+    {
+        CPUFreq = OSFreq * CPUElapsed / OSElapsed;
+    }
+
+    return CPUFreq;
+}
+
+u64 ReadCPUTimer(void)
+{
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+    return __rdtsc();
+
+#elif defined(__aarch64__)
+    // ARMv8 (AArch64): use CNTVCT_EL0
+    uint64_t cnt;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cnt));
+    return cnt;
+
+#else
+    return ReadOSTimer();
+#endif
+}
+
+PerfCounters PerfCounters::Open()
+{
+    PerfCounters result = {};
+    u64 configs[Count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS};
+    u64 pageSize = u64(sysconf(_SC_PAGESIZE));
+
+    result.valid = true;
+    result.userspace = true;
+    for (u32 i = 0; i < Count; i++)
+    {
+        result.fds[i] = -1;
+        result.pages[i] = nullptr;
+        if (!result.valid)
+            continue;
+
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        result.fds[i] = i32(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (result.fds[i] < 0)
+        {
+            result.valid = false;
+            continue;
+        }
+
+        void *page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, result.fds[i], 0);
+        if (page == MAP_FAILED)
+        {
+            result.userspace = false;
+            continue;
+        }
+
+        result.pages[i] = page;
+        if (!((perf_event_mmap_page *)page)->cap_user_rdpmc)
+            result.userspace = false;
+    }
+
+    if (!result.valid)
+    {
+        persist bool warned = false;
+        if (!warned)
+            WARN("Hardware counters unavailable (check perf_event_paranoid)");
+        warned = true;
+        result.Close();
+    }
+
+    return result;
+}
+
+void PerfCounters::Close()
+{
+    u64 pageSize = u64(sysconf(_SC_PAGESIZE));
+    for (u32 i = 0; i < Count; i++)
+    {
+        if (pages[i])
+            munmap(pages[i], pageSize);
+        if (fds[i] >= 0)
+            close(fds[i]);
+        pages[i] = nullptr;
+        fds[i] = -1;
+    }
+
+    valid = false;
+}
+
+// Follows the seqlock protocol documented in linux/perf_event.h: retry if the kernel updated
+// the page (e.g. on a context switch) while we were reading it.
+internal u64 ReadPerfCounter(i32 fd, volatile perf_event_mmap_page *page)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (page)
+    {
+        u32 seq, index;
+        i64 count;
+        do
+        {
+            seq = page->lock;
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+            index = page->index;
+            count = page->offset;
+            if (!page->cap_user_rdpmc || index == 0)
+                break;
+
+            u32 width = page->pmc_width;
+            i64 pmc = i64(__rdpmc(i32(index - 1)));
+            pmc <<= 64 - width;
+            pmc >>= 64 - width;
+            count += pmc;
+
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        } while (page->lock != seq);
+
+        if (page->cap_user_rdpmc && index != 0)
+            return u64(count);
+    }
+#endif
+
+    u64 value = 0;
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+}
+
+// Without rdpmc on every counter, all of them go through read() so the pair stays consistent.
+void PerfCounters::Read(u64 values[Count])
+{
+    for (u32 i = 0; i < Count; i++)
+    {
+        perf_event_mmap_page *page = userspace ? (perf_event_mmap_page *)pages[i] : nullptr;
+        values[i] = valid ? ReadPerfCounter(fds[i], page) : 0;
+    }
+}
+
+SystemInfo SystemInfo::Query()
+{
+    SystemInfo result = {};
+
+    // System
+    result.platformName = "Linux";
+    result.processorArchitecture = "Unknown";
+
+    utsname uts;
+    if (uname(&uts) == 0)
+    {
+        persist char machine[sizeof(uts.machine)];
+        memcpy(machine, uts.machine, sizeof(machine));
+        result.processorArchitecture = machine;
+
+        sscanf(uts.release, "%u.%u.%u", &result.majorVersion, &result.minorVersion, &result.buildNumber);
+    }
+
+    result.numberOfProcessors = u32(sysconf(_SC_NPROCESSORS_ONLN));
+    result.pageSize = u32(sysconf(_SC_PAGESIZE));
+    result.allocationGranularity = result.pageSize;
+
+    result.cpuFreq = f64(GetCPUTimerFreq()) / 1000.0 / 1000.0 / 1000.0;
+
+    // Memory
+    struct sysinfo memInfo;
+    if (sysinfo(&memInfo) == 0)
+    {
+        result.totalPhys = u64(memInfo.totalram) * memInfo.mem_unit;
+        result.availPhys = u64(memInfo.freeram) * memInfo.mem_unit;
+        result.totalVirtual = u64(memInfo.totalram + memInfo.totalswap) * memInfo.mem_unit;
+        result.availVirtual = u64(memInfo.freeram + memInfo.freeswap) * memInfo.mem_unit;
+    }
+
+    return result;
+}
@@ -17,6 +17,10 @@
 #endif
 
 #include <Psapi.h>
+#include <intrin.h>
+#include <DbgHelp.h>
+
+#pragma comment(lib, "dbghelp.lib")
 
 #undef EXPORT
 #define EXPORT extern "C" __declspec(dllexport)
@@ -89,7 +93,300 @@ u64 ReadCPUTimer(void)
 #endif
 }
 
-SystemInfo SystemInfo::Init()
+u64 ReadOSTimer(void)
+{
+    LARGE_INTEGER perfCounter;
+    QueryPerformanceCounter(&perfCounter);
+    return perfCounter.QuadPart;
+}
+
+u64 GetOSTimerFreq(void)
+{
+    LARGE_INTEGER perfFreq;
+    QueryPerformanceFrequency(&perfFreq);
+    return perfFreq.QuadPart;
+}
+
+u64 ReadThreadCPUTime(void)
+{
+    // FILETIMEs are in 100ns units. Resolution is the scheduler tick (~15ms), so this is only
+    // meaningful for blocks that run long enough to span several quanta.
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+
+    u64 kernelTime = (u64(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+    u64 userTime = (u64(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+    return (kernelTime + userTime) * 100;
+}
+
+u32 GetThreadID(void) { return GetCurrentThreadId(); }
+
+u32 GetProcessID(void) { return GetCurrentProcessId(); }
+
+bool IsProcessAlive(u32 pid)
+{
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, DWORD(pid));
+    if (!process)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+}
+
+bool InstallDumpSignal(void (*handler)(int)) { return false; }
+
+u32 GetCurrentCPU(u32 *node)
+{
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+
+    USHORT numaNode = 0;
+    GetNumaProcessorNodeEx(&processor, &numaNode);
+    *node = numaNode;
+    return u32(processor.Group) * 64 + processor.Number;
+}
+
+bool ReadCPUID(u32 leaf, u32 subleaf, u32 regs[4])
+{
+#if defined(_M_X64) || defined(_M_IX86)
+    int info[4];
+    __cpuid(info, int(leaf & 0x80000000));
+    if (u32(info[0]) < leaf)
+        return false;
+
+    __cpuidex(info, int(leaf), int(subleaf));
+    for (int i = 0; i < 4; i++)
+        regs[i] = u32(info[i]);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Windows doesn't publish its TSC calibration.
+u64 ReadKernelCPUTimerFreq(void) { return 0; }
+
+// Large pages need SeLockMemoryPrivilege; without it VirtualAlloc fails and we use normal pages.
+void *ReserveMemory(u64 size, bool largePages, bool *gotLargePages)
+{
+    *gotLargePages = false;
+    SIZE_T largePageSize = GetLargePageMinimum();
+    if (largePages && largePageSize)
+    {
+        u64 rounded = (size + largePageSize - 1) & ~u64(largePageSize - 1);
+        void *memory =
+            VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (memory)
+        {
+            // Large pages are always resident.
+            *gotLargePages = true;
+            return memory;
+        }
+    }
+
+    void *memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (memory)
+        PrefaultMemory(memory, size);
+    return memory;
+}
+
+void ReleaseMemory(void *memory, u64 size, bool largePages) { VirtualFree(memory, 0, MEM_RELEASE); }
+
+void *MapSharedMemory(cstr path, u64 size)
+{
+    HANDLE file = INVALID_HANDLE_VALUE;
+    if (path)
+    {
+        file = CreateFileA(path,
+                           GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           nullptr,
+                           OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL,
+                           nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return nullptr;
+    }
+
+    HANDLE mapping =
+        CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(size >> 32), DWORD(size), nullptr);
+    void *memory = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : nullptr;
+
+    // The view keeps the mapping alive.
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    return memory;
+}
+
+void UnmapSharedMemory(void *memory, u64 size) { UnmapViewOfFile(memory); }
+
+bool InstallForkHandler(void (*handler)(void)) { return false; }
+
+void PrefaultMemory(void *memory, u64 size)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    volatile u8 *bytes = (volatile u8 *)memory;
+    for (u64 at = 0; at < size; at += info.dwPageSize)
+        bytes[at] = bytes[at];
+    if (size)
+        bytes[size - 1] = bytes[size - 1];
+}
+
+bool FlushCacheLines(void *memory, u64 size)
+{
+#if defined(_M_X64) || defined(_M_IX86)
+    u8 *from = (u8 *)(u64(memory) & ~63ull);
+    u8 *to = (u8 *)memory + size;
+    for (u8 *line = from; line < to; line += 64)
+        _mm_clflush(line);
+    _mm_mfence();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Unlocking pages that aren't locked trims them from the working set; the next touch soft faults
+// them back in with their contents intact.
+void DiscardMemory(void *memory, u64 size) { VirtualUnlock(memory, size); }
+
+u64 GetLastLevelCacheSize(void)
+{
+    DWORD length = 0;
+    GetLogicalProcessorInformation(nullptr, &length);
+
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION infos[256];
+    if (length > sizeof(infos) || !GetLogicalProcessorInformation(infos, &length))
+        return 0;
+
+    u64 result = 0;
+    u32 level = 0;
+    for (u32 i = 0; i < length / sizeof(infos[0]); i++)
+    {
+        if (infos[i].Relationship != RelationCache || infos[i].Cache.Level < level)
+            continue;
+        level = infos[i].Cache.Level;
+        result = infos[i].Cache.Size;
+    }
+
+    return result;
+}
+
+bool ResolveSymbol(void *address, char *name, u64 nameLen, char *module, u64 moduleLen)
+{
+    HANDLE process = GetCurrentProcess();
+    persist bool initialized = SymInitialize(process, nullptr, TRUE) != 0;
+    if (!initialized)
+        return false;
+
+    HMODULE handle = nullptr;
+    module[0] = 0;
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                           (LPCSTR)address,
+                           &handle))
+        GetModuleFileNameA(handle, module, DWORD(moduleLen));
+
+    u8 buffer[sizeof(SYMBOL_INFO) + 256];
+    SYMBOL_INFO *symbol = (SYMBOL_INFO *)buffer;
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen = 256;
+
+    DWORD64 displacement = 0;
+    if (!SymFromAddr(process, DWORD64(address), &displacement, symbol))
+        return false;
+
+    snprintf(name, nameLen, "%s", symbol->Name);
+    return true;
+}
+
+// Mask the thread had before its first PinThreadToCPU, restored by ResetThreadAffinity.
+persist thread_local DWORD_PTR savedAffinity = 0;
+
+bool PinThreadToCPU(u32 cpu)
+{
+    if (cpu >= 64)
+        return false;
+
+    DWORD_PTR previous = SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+    if (previous == 0)
+        return false;
+
+    if (savedAffinity == 0)
+        savedAffinity = previous;
+    return true;
+}
+
+void ResetThreadAffinity(void)
+{
+    if (savedAffinity == 0)
+        return;
+
+    SetThreadAffinityMask(GetCurrentThread(), savedAffinity);
+    savedAffinity = 0;
+}
+
+persist thread_local i32 savedPriority = THREAD_PRIORITY_ERROR_RETURN;
+
+bool RaiseThreadPriority(void)
+{
+    if (savedPriority == THREAD_PRIORITY_ERROR_RETURN)
+        savedPriority = GetThreadPriority(GetCurrentThread());
+
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+}
+
+void ResetThreadPriority(void)
+{
+    if (savedPriority == THREAD_PRIORITY_ERROR_RETURN)
+        return;
+
+    SetThreadPriority(GetCurrentThread(), savedPriority);
+    savedPriority = THREAD_PRIORITY_ERROR_RETURN;
+}
+
+// Power plans don't map onto governors and turbo state isn't exposed without a driver.
+void ReadFrequencyPolicy(u32 cpu, char *governor, u64 governorLen, i32 *turbo)
+{
+    governor[0] = 0;
+    *turbo = -1;
+}
+
+u32 CountSMTSiblings(u32 cpu)
+{
+    DWORD length = 0;
+    GetLogicalProcessorInformation(nullptr, &length);
+
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION infos[256];
+    if (cpu >= 64 || length > sizeof(infos) || !GetLogicalProcessorInformation(infos, &length))
+        return 0;
+
+    for (u32 i = 0; i < length / sizeof(infos[0]); i++)
+    {
+        if (infos[i].Relationship == RelationProcessorCore && (infos[i].ProcessorMask >> cpu) & 1)
+            return u32(__popcnt64(infos[i].ProcessorMask));
+    }
+
+    return 0;
+}
+
+// Windows doesn't give user mode access to hardware counters without a driver.
+PerfCounters PerfCounters::Open() { return PerfCounters{}; }
+
+void PerfCounters::Close() {}
+
+void PerfCounters::Read(u64 values[Count])
+{
+    for (u32 i = 0; i < Count; i++)
+        values[i] = 0;
+}
+
+SystemInfo SystemInfo::Query()
 {
     SystemInfo result = {};
     SYSTEM_INFO sysInfo;
@@ -103,6 +400,7 @@ SystemInfo SystemInfo::Init()
     result.pageSize = sysInfo.dwPageSize;
     result.allocationGranularity = sysInfo.dwAllocationGranularity;
 
+    result.platformName = "Windows";
     result.processorArchitecture = "Unknown";
     switch (sysInfo.wProcessorArchitecture)
     {
@@ -120,7 +418,7 @@ SystemInfo SystemInfo::Init()
         break;
     }
 
-    result.cpuFreq = f64(EstimateCPUTimerFreq()) / 1000.0 / 1000.0 / 1000.0;
+    result.cpuFreq = f64(GetCPUTimerFreq()) / 1000.0 / 1000.0 / 1000.0;
 
     // Memory
     memInfo.dwLength = sizeof(memInfo);
@@ -151,7 +449,5 @@ SystemInfo SystemInfo::Init()
         result.majorVersion = result.minorVersion = result.buildNumber = result.platformId = 0;
     }
 
-    result.Print();
-
     return result;
 }
\ No newline at end of file
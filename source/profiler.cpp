@@ -1,4 +1,5 @@
 #include "profiler.hpp"
+#include "symbolizer.hpp"
 
 persist Metrics _Metrics;
 Metrics &Metrics::Get()
@@ -6,284 +7,2759 @@ Metrics &Metrics::Get()
     return _Metrics;
 }
 
-Profiler::Profiler(cstr _name) : name{_name}, ended{false}, start{0}, blocks{}, queue{}
+// Offset of each core's CPU timer against the OS clock, relative to the first core. The first
+// core is sampled again at the end so drift from an imprecise frequency can be removed.
+internal f64 MeasureCPUTimerSkew(u64 cpuTimerFreq)
 {
-    LARGE_INTEGER perfCounter;
-    QueryPerformanceCounter(&perfCounter);
-    start = perfCounter.QuadPart;
+    u32 cpus = std::thread::hardware_concurrency();
+    f64 osToTicks = f64(cpuTimerFreq) / f64(GetOSTimerFreq());
+    u64 osStart = ReadOSTimer();
+    u64 cpuStart = ReadCPUTimer();
+
+    auto sample = [&](f64 &offset, u64 &at)
+    {
+        u64 window = ~0ull;
+        for (u32 i = 0; i < 32; i++)
+        {
+            u64 before = ReadOSTimer();
+            u64 ticks = ReadCPUTimer();
+            u64 after = ReadOSTimer();
+            if (after - before < window)
+            {
+                window = after - before;
+                at = before + window / 2 - osStart;
+                offset = f64(i64(ticks - cpuStart)) - f64(at) * osToTicks;
+            }
+        }
+    };
+
+    StackArray<f64, 256> offsets = {};
+    StackArray<u64, 256> times = {};
+    StackArray<u32, 256> pinned = {};
+    for (u32 cpu = 0; cpu < cpus && pinned.len < pinned.cap; cpu++)
+    {
+        if (!PinThreadToCPU(cpu))
+            continue;
+
+        sample(offsets[offsets.len++], times[times.len++]);
+        pinned[pinned.len++] = cpu;
+    }
+
+    if (pinned.len < 2)
+    {
+        ResetThreadAffinity();
+        return 0;
+    }
+
+    f64 endOffset = 0;
+    u64 endTime = 0;
+    PinThreadToCPU(pinned[0]);
+    sample(endOffset, endTime);
+    ResetThreadAffinity();
+
+    f64 drift = endTime > times[0] ? (endOffset - offsets[0]) / f64(endTime - times[0]) : 0;
+    f64 lo = 0, hi = 0;
+    for (u64 i = 0; i < offsets.len; i++)
+    {
+        f64 offset = offsets[i] - offsets[0] - drift * f64(times[i] - times[0]);
+        lo = offset < lo ? offset : lo;
+        hi = offset > hi ? offset : hi;
+    }
+
+    return (hi - lo) * 1e9 / f64(cpuTimerFreq);
+}
+
+Timebase Timebase::Init()
+{
+    Timebase result = {};
+    u32 regs[4] = {};
+
+#if defined(__aarch64__)
+    // The generic timer is constant-rate and synchronized by the architecture.
+    result.invariant = true;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(result.cpuTimerFreq));
+    result.source = "CNTFRQ_EL0";
+#else
+    result.invariant = ReadCPUID(0x80000007, 0, regs) && (regs[3] & (1u << 8));
+#endif
+
+    if (!result.cpuTimerFreq && (result.cpuTimerFreq = ReadKernelCPUTimerFreq()))
+    {
+        result.source = "kernel";
+    }
+
+    // TSC/crystal ratio and crystal frequency (Intel Skylake and later).
+    if (!result.cpuTimerFreq && ReadCPUID(0x15, 0, regs) && regs[0] && regs[1] && regs[2])
+    {
+        result.cpuTimerFreq = u64(regs[2]) * regs[1] / regs[0];
+        result.source = "CPUID 0x15";
+    }
+
+    // Nominal base frequency in MHz, which the TSC runs at on Intel parts.
+    if (!result.cpuTimerFreq && ReadCPUID(0x16, 0, regs) && regs[0])
+    {
+        result.cpuTimerFreq = u64(regs[0]) * 1000000ull;
+        result.source = "CPUID 0x16";
+    }
+
+    // Estimating an unreported frequency would spin for 100ms at load, so that takes the OS clock.
+    result.useCPUTimer = result.invariant && result.cpuTimerFreq;
+#ifdef PROFILER_OS_TIMER
+    result.useCPUTimer = false;
+#endif
+    result.freq = result.useCPUTimer ? result.cpuTimerFreq : GetOSTimerFreq();
+    return result;
+}
+
+void Timebase::Calibrate()
+{
+    persist std::once_flag once;
+    std::call_once(once,
+                   []
+                   {
+                       Timebase &result = _Timebase;
+                       if (!result.invariant)
+                           WARN("CPU timer is not invariant, using the OS clock");
+                       if (!result.useCPUTimer)
+                           return;
+
+                       result.maxSkewNs = MeasureCPUTimerSkew(result.cpuTimerFreq);
+                       result.calibrated = true;
+                       if (result.maxSkewNs > MAX_TSC_SKEW_NS)
+                       {
+                           WARN("CPU timer skew across cores is %.0f ns, timestamps compared across threads "
+                                "may be off by as much; build with -DPROFILER_OS_TIMER to use the OS clock",
+                                result.maxSkewNs);
+                       }
+                   });
+}
+
+void Timebase::Print() const
+{
+    INFO("Timebase");
+    printf("\t> Timer: \t\t\t%s\n", useCPUTimer ? "CPU timer" : "OS clock");
+    if (cpuTimerFreq)
+        printf("\t> CPU Timer Frequency: \t\t%.6f GHz (%s)\n", f64(cpuTimerFreq) / 1e9, source);
+    else
+        printf("\t> CPU Timer Frequency: \t\tnot reported\n");
+    printf("\t> Invariant: \t\t\t%s\n", invariant ? "yes" : "no");
+    if (calibrated)
+        printf("\t> Cross-core Skew: \t\t%.0f ns\n", maxSkewNs);
+    else if (useCPUTimer)
+        printf("\t> Cross-core Skew: \t\tnot measured (PROFILER_START)\n");
+}
+
+// Defined before Profiler::_Profiler, whose constructor already reads the timer.
+Timebase Timebase::_Timebase = Timebase::Init();
+
+// Estimated on demand when the timebase has no reported frequency, which leaves its clock alone.
+u64 GetCPUTimerFreq(void)
+{
+    persist u64 estimated = 0;
+    if (Timebase::Get().cpuTimerFreq)
+        return Timebase::Get().cpuTimerFreq;
+    if (!estimated)
+        estimated = EstimateCPUTimerFreq();
+    return estimated;
+}
+
+Profiler::Profiler(cstr _name)
+    : name{_name}, ended{false}, start{0}, trackCPUTime{false}, trackPlacement{false},
+      numaNodes{1}, blocks{}, queue{}, counterInterval{0}, liveLocks{nullptr}, recorder{}
+{
+    // The block, counter and flow tables are zero-initialized statics, so the first touch of
+    // each page would otherwise fault inside a measured block.
+    PrefaultMemory(this, sizeof(*this));
+    autoBlocks.maxDepth = AUTO_MAX_DEPTH;
+    start = ReadTimer();
+}
+
+void Profiler::Start() { Timebase::Calibrate(); }
+
+// Nodes past MAX_NUMA_NODES are folded into the last one.
+u32 Profiler::ReadPlacement(u32 *node)
+{
+    u32 processor = GetCurrentCPU(node);
+    if (*node >= MAX_NUMA_NODES)
+        *node = MAX_NUMA_NODES - 1;
+    if (*node >= numaNodes)
+        numaNodes = *node + 1;
+    return processor;
+}
+
+void Profiler::BeginBlock(u64 id, cstr label, cstr file, i32 line, u64 bytesProcessed, u64 weight)
+{
+    EnterBlock(id, label, file, line, bytesProcessed, weight);
+}
+
+void Profiler::AddBytes(u64 bytes)
+{
+    Block &m = blocks[queue.Last()];
+    m.bytesProcessed += bytes;
+    m.nodeBytes[m.node] += bytes;
+    m.activationBytes += bytes;
+}
+
+// Attached to the innermost open block's current execution, reported with its exemplars.
+void Profiler::SetTag(u64 tag) { blocks[queue.Last()].tag = tag; }
+
+internal i32 BySlowest(const void *from, const void *to)
+{
+    u64 a = ((const Exemplar *)from)->duration, b = ((const Exemplar *)to)->duration;
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+internal void KeepIfSlowest(Block *m, u64 duration)
+{
+    if (m->slowestLen == MAX_EXEMPLARS && duration <= m->slowest[0].duration)
+        return;
+
+    Exemplar exemplar = {
+        .duration = duration,
+        .start = m->entered,
+        .bytes = m->activationBytes,
+        .tag = m->tag,
+        .thread = GetThreadID(),
+    };
+
+    Exemplar *heap = m->slowest;
+    u32 i;
+    if (m->slowestLen < MAX_EXEMPLARS)
+    {
+        // Sift up from the new leaf.
+        i = m->slowestLen++;
+        while (i > 0 && heap[(i - 1) / 2].duration > duration)
+        {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    }
+    else
+    {
+        // Replace the root and sift down.
+        i = 0;
+        for (;;)
+        {
+            u32 child = 2 * i + 1;
+            if (child >= m->slowestLen)
+                break;
+            if (child + 1 < m->slowestLen && heap[child + 1].duration < heap[child].duration)
+                child++;
+            if (heap[child].duration >= duration)
+                break;
+            heap[i] = heap[child];
+            i = child;
+        }
+    }
+
+    heap[i] = exemplar;
+}
+
+void CounterInterval::Add(f64 value)
+{
+    if (count == 0 || value < min)
+        min = value;
+    if (count == 0 || value > max)
+        max = value;
+
+    last = value;
+    sum += value;
+    count++;
+}
+
+void Profiler::SetCounter(u64 id, cstr label, f64 value, cstr file, i32 line)
+{
+    if (id >= counters.cap)
+    {
+        return;
+    }
+
+    Counter *c = &counters[id];
+    c->label = label;
+    c->file = file;
+    c->line = line;
+    c->total.Add(value);
+
+    bool recording = recorder.active.load(std::memory_order_relaxed);
+    if (counterInterval == 0 && !recording)
+        return;
+
+    u64 now = ReadTimer();
+    if (recording)
+    {
+        u64 bits;
+        memcpy(&bits, &value, sizeof(bits));
+        recorder.Record(TraceCounter, u32(id), now, bits);
+    }
+
+    if (counterInterval == 0)
+        return;
+
+    if (c->current.count == 0)
+    {
+        c->current.from = now;
+    }
+    else if (now - c->current.from >= counterInterval)
+    {
+        c->history[c->intervals % MAX_COUNTER_INTERVALS] = c->current;
+        c->intervals++;
+        c->current = CounterInterval{.from = now};
+    }
+
+    c->current.Add(value);
+}
+
+Profiler::BlockFlag
+Profiler::BeginScopeBlock(i32 id, cstr label, cstr file, i32 line, u64 bytesProcessed)
+{
+    BeginBlock(id, label, file, line, bytesProcessed);
+    return BlockFlag{.parent = this};
+}
+
+Profiler::BlockFlag
+Profiler::BeginBudgetScopeBlock(i32 id, cstr label, u64 budgetNs, cstr file, i32 line, u64 bytesProcessed)
+{
+    // Converted on every entry, never cached by the call site, so it always matches ReadTimer().
+    if (u64(id) < blocks.cap)
+        blocks[id].budget = Timebase::Get().FromNs(f64(budgetNs));
+
+    BeginBlock(id, label, file, line, bytesProcessed);
+    return BlockFlag{.parent = this};
+}
+
+Profiler::BlockFlag
+Profiler::BeginCPUScopeBlock(i32 id, cstr label, cstr file, i32 line, u64 bytesProcessed)
+{
+    if (u64(id) < blocks.cap)
+        blocks[id].splitCPU = true;
+
+    BeginBlock(id, label, file, line, bytesProcessed);
+    return BlockFlag{.parent = this};
+}
+
+u32 SampleSite::NextGap()
+{
+    if (!randomized || rate <= 1)
+        return rate ? rate : 1;
+
+    // xorshift32, one state per thread
+    persist thread_local u32 state = 2463534242u ^ GetThreadID();
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return 1 + state % (2 * rate - 1);
+}
+
+Profiler::BlockFlag Profiler::BeginSampledScopeBlock(
+    SampleSite &site, i32 id, cstr label, cstr file, i32 line, u64 bytesProcessed)
+{
+    u64 weight = site.skipped;
+    site.skipped = 0;
+    site.countdown = site.NextGap();
+
+    BeginBlock(id, label, file, line, bytesProcessed, weight);
+    return BlockFlag{.parent = this};
+}
+
+// Everything ExitBlock only needs for some executions, out of line to keep the inlined path
+// small.
+void Profiler::FinishBlock(Block *m, u64 id, u64 now)
+{
+    KeepIfSlowest(m, now - m->entered);
+
+    if (m->budget && now - m->entered > m->budget)
+    {
+        m->violations++;
+        if (budgets.hook)
+        {
+            Timebase &timebase = Timebase::Get();
+            BudgetViolation violation = {
+                .label = m->label,
+                .file = m->file,
+                .line = m->line,
+                .thread = GetThreadID(),
+                .durationNs = u64(timebase.ToNs(now - m->entered) + 0.5),
+                .budgetNs = u64(timebase.ToNs(m->budget) + 0.5),
+                .start = m->entered,
+                .tag = m->tag,
+            };
+            budgets.Report(violation);
+        }
+    }
+
+    if (recorder.active.load(std::memory_order_relaxed))
+    {
+        if (recorder.threshold && now - m->entered > recorder.threshold)
+            recorder.RequestDump();
+        recorder.Record(TraceEnd, u32(id), now, m->activationBytes);
+    }
+
+    if (activeRep)
+        activeRep->inner.Add(id, now - m->entered);
+}
+
+void Profiler::EndBlock() { ExitBlock(); }
+
+void BudgetQueue::Init()
+{
+    for (u64 i = 0; i < MAX_BUDGET_QUEUE; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    head = 0;
+    sleeping.store(false, std::memory_order_relaxed);
+}
+
+bool BudgetQueue::Push(const BudgetViolation &item)
+{
+    u64 at = tail.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Slot &slot = slots[at & (MAX_BUDGET_QUEUE - 1)];
+        i64 diff = i64(slot.sequence.load(std::memory_order_acquire)) - i64(at);
+        if (diff == 0)
+        {
+            // Free for this round: claim it, or retry from wherever the tail moved to.
+            if (tail.compare_exchange_weak(at, at + 1, std::memory_order_relaxed))
+            {
+                slot.item = item;
+                slot.sequence.store(at + 1, std::memory_order_release);
+
+                // Pairs with the fence in RunBudgetHooks: either it sees the item, or this sees
+                // it sleeping.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (sleeping.load(std::memory_order_relaxed))
+                    Wake();
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Still holds the item from one round ago.
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            at = tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool BudgetQueue::Pop(BudgetViolation *item)
+{
+    Slot &slot = slots[head & (MAX_BUDGET_QUEUE - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+        return false;
+
+    *item = slot.item;
+    slot.sequence.store(head + MAX_BUDGET_QUEUE, std::memory_order_release);
+    head++;
+    return true;
+}
+
+bool BudgetQueue::Empty()
+{
+    return slots[head & (MAX_BUDGET_QUEUE - 1)].sequence.load(std::memory_order_acquire) != head + 1;
+}
+
+void BudgetQueue::Wake()
+{
+    wakeups.fetch_add(1, std::memory_order_release);
+    wakeups.notify_one();
+}
+
+internal void RunBudgetHooks(LatencyBudgets &budgets)
+{
+    BudgetQueue &queue = budgets.queue;
+    BudgetViolation violation;
+    for (;;)
+    {
+        bool stopping = !budgets.running.load(std::memory_order_acquire);
+        while (queue.Pop(&violation))
+            budgets.hook(violation, budgets.context);
+        if (stopping)
+            return;
+
+        u32 seen = queue.wakeups.load(std::memory_order_acquire);
+        queue.sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (queue.Empty() && budgets.running.load(std::memory_order_acquire))
+            queue.wakeups.wait(seen, std::memory_order_acquire);
+        queue.sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+// Set it once, before the budgeted blocks run.
+void LatencyBudgets::SetHook(BudgetHook newHook, void *newContext)
+{
+    if (running.load(std::memory_order_relaxed))
+    {
+        WARN("Budget hook already set");
+        return;
+    }
+
+    queue.Init();
+    context = newContext;
+    hook = newHook;
+    running.store(true, std::memory_order_release);
+    worker = std::thread(RunBudgetHooks, std::ref(*this));
+}
+
+void LatencyBudgets::Report(const BudgetViolation &violation)
+{
+    if (running.load(std::memory_order_relaxed))
+        queue.Push(violation);
+}
+
+void LatencyBudgets::Stop()
+{
+    if (!running.load(std::memory_order_relaxed))
+        return;
+
+    running.store(false, std::memory_order_release);
+    queue.Wake();
+    worker.join();
+
+    u64 dropped = queue.dropped.load(std::memory_order_relaxed);
+    if (dropped)
+        WARN("%llu budget violations didn't reach the hook, raise MAX_BUDGET_QUEUE", dropped);
+}
+
+internal void PublishAtExit() { Profiler::Get().End(); }
+
+// Forked workers inherit the parent's stats; they start over, keeping labels and budgets, and
+// publish on exit().
+internal void ResetAfterFork()
+{
+    Profiler &profiler = Profiler::Get();
+    atexit(PublishAtExit);
+    profiler.recorder.Forked();
+    profiler.fleet.slot = nullptr;
+    profiler.fleet.carried = nullptr;
+    profiler.fleet.claimed = false;
+    profiler.start = ReadTimer();
+
+    for (u64 i = 0; i < profiler.blocks.cap; i++)
+    {
+        Block &block = profiler.blocks[i];
+        Block fresh = {};
+        fresh.label = block.label;
+        fresh.file = block.file;
+        fresh.line = block.line;
+        fresh.budget = block.budget;
+        fresh.weight = block.weight;
+        fresh.splitCPU = block.splitCPU;
+        block = fresh;
+    }
+
+    for (u64 id : profiler.queue)
+    {
+        profiler.blocks[id].from = profiler.start;
+        profiler.blocks[id].entered = profiler.start;
+    }
+
+    // A thread that doesn't exist here may have held a flow slot at the fork.
+    for (u64 i = 0; i < profiler.flows.len; i++)
+    {
+        for (Flow::Pending &slot : profiler.flows[i].pending)
+        {
+            if (slot.key.load(std::memory_order_relaxed) == FLOW_BUSY)
+                slot.key.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool ProfilerFleet::Create(u32 maxWorkers, cstr path)
+{
+    if (header)
+        return true;
+
+    u32 maxBlocks = u32(Profiler::Get().blocks.cap);
+    size = FleetBytes(maxWorkers, maxBlocks);
+    header = (FleetHeader *)MapSharedMemory(path, size);
+    if (!header)
+    {
+        ERR("Couldn't map %llu bytes of shared memory for %u workers", size, maxWorkers);
+        return false;
+    }
+
+    memset((void *)header, 0, size);
+    memcpy(header->magic, FLEET_MAGIC, sizeof(header->magic));
+    header->version = FLEET_VERSION;
+    header->maxWorkers = maxWorkers;
+    header->maxBlocks = maxBlocks;
+    header->owner = GetProcessID();
+
+    if (!InstallForkHandler(ResetAfterFork))
+        WARN("No fork on this platform, only processes mapping %s can publish", path ? path : "the region");
+    return true;
+}
+
+// Carried totals may come from a process on another clock, e.g. one mapping the fleet file.
+internal void RescaleFleetSlot(FleetSlot *slot, u32 maxBlocks, u64 freq)
+{
+    if (!slot->freq || slot->freq == freq)
+        return;
+
+    f64 scale = f64(freq) / f64(slot->freq);
+    slot->freq = freq;
+    slot->start = slot->end - u64(f64(slot->end - slot->start) * scale);
+    for (u32 b = 0; b < slot->blockCount && b < maxBlocks; b++)
+    {
+        FleetBlock &block = slot->Blocks()[b];
+        block.timeEx = u64(f64(block.timeEx) * scale);
+        block.timeInc = u64(f64(block.timeInc) * scale);
+        block.worst = u64(f64(block.worst) * scale);
+    }
+}
+
+// Free slots first, then those of exited workers. A slot already held by our pid belonged to a
+// worker that exited before the pid was reused. Taking one over copies out what it published.
+internal FleetSlot *ClaimFleetSlot(FleetHeader *header, FleetSlot **carried)
+{
+    u32 pid = GetProcessID();
+    for (u32 pass = 0; pass < 2; pass++)
+    {
+        for (u32 i = 0; i < header->maxWorkers; i++)
+        {
+            FleetSlot *slot = GetFleetSlot(header, i);
+            u32 owner = slot->owner.load(std::memory_order_acquire);
+            bool open = pass == 0 ? owner == 0 : owner != 0 && (owner == pid || !IsProcessAlive(owner));
+            if (!open || !slot->owner.compare_exchange_strong(owner, pid, std::memory_order_acq_rel))
+                continue;
+            if (owner == 0)
+                return slot;
+
+            *carried = (FleetSlot *)malloc(FleetSlotBytes(header->maxBlocks));
+            if (*carried && ReadFleetSlot(slot, *carried, header->maxBlocks) != FleetPublished)
+            {
+                free(*carried);
+                *carried = nullptr;
+            }
+            if (*carried)
+                RescaleFleetSlot(*carried, header->maxBlocks, Timebase::Get().freq);
+            return slot;
+        }
+    }
+    return nullptr;
+}
+
+// The worker is the slot's only writer, so a sequence number is enough: odd while writing.
+void ProfilerFleet::Publish()
+{
+    if (!IsWorker())
+        return;
+
+    Profiler &profiler = Profiler::Get();
+    if (!claimed)
+    {
+        // Forks that never recorded anything, like fork/exec helpers, leave the slots to workers.
+        bool recorded = false;
+        for (u64 i = 1; i < profiler.blocks.cap && !recorded; i++)
+            recorded = profiler.blocks[i].iterations != 0;
+        if (!recorded)
+            return;
+
+        claimed = true;
+        header->workers.fetch_add(1, std::memory_order_relaxed);
+        slot = ClaimFleetSlot(header, &carried);
+        if (!slot)
+            header->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!slot)
+        return;
+
+    // A worker taking over may find the sequence odd, left by one that died while publishing.
+    u64 sequence = slot->sequence.load(std::memory_order_relaxed);
+    sequence += sequence & 1;
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->pid = GetProcessID();
+    slot->workers = carried ? carried->workers + 1 : 1;
+    slot->freq = Timebase::Get().freq;
+    slot->start = carried ? profiler.start - (carried->end - carried->start) : profiler.start;
+    slot->end = ReadTimer();
+    u32 count = 0;
+    for (u64 i = 1; i < profiler.blocks.cap && count < header->maxBlocks; i++)
+    {
+        Block &block = profiler.blocks[i];
+        if (block.iterations == 0)
+            continue;
+
+        u64 worst = 0;
+        for (u32 j = 0; j < block.slowestLen; j++)
+            worst = block.slowest[j].duration > worst ? block.slowest[j].duration : worst;
+
+        FleetBlock &out = slot->Blocks()[count++];
+        snprintf(out.label, sizeof(out.label), "%s", block.label);
+        out.iterations = block.iterations;
+        out.timeEx = block.timeEx;
+        out.timeInc = block.timeInc;
+        out.bytes = block.bytesProcessed;
+        out.violations = block.violations;
+        out.worst = worst;
+    }
+
+    // The exited workers' totals, merged by label.
+    for (u32 c = 0; carried && c < carried->blockCount && c < header->maxBlocks; c++)
+    {
+        FleetBlock &from = carried->Blocks()[c];
+        u32 b = 0;
+        while (b < count && strcmp(slot->Blocks()[b].label, from.label) != 0)
+            b++;
+        if (b == header->maxBlocks)
+            continue;
+
+        FleetBlock &to = slot->Blocks()[b];
+        if (b == count)
+        {
+            count++;
+            to = from;
+            continue;
+        }
+        to.iterations += from.iterations;
+        to.timeEx += from.timeEx;
+        to.timeInc += from.timeInc;
+        to.bytes += from.bytes;
+        to.violations += from.violations;
+        to.worst = from.worst > to.worst ? from.worst : to.worst;
+    }
+    slot->blockCount = count;
+
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool ProfilerArena::Reserve(u64 bytes)
+{
+    std::lock_guard<std::mutex> lock(reserveLock);
+    if (reserved.load(std::memory_order_relaxed))
+        return bytes <= size;
+
+    base = (u8 *)ReserveMemory(bytes, PROFILER_LARGE_PAGES, &largePages);
+    failed.store(!base, std::memory_order_release);
+    if (!base)
+    {
+        ERR("Couldn't reserve %llu bytes, the profiler falls back to the heap", bytes);
+        return false;
+    }
+
+    size = bytes;
+    reserved.store(true, std::memory_order_release);
+    return true;
+}
+
+void *ProfilerArena::Alloc(u64 bytes, u64 align)
+{
+    if (!reserved.load(std::memory_order_acquire) && !failed.load(std::memory_order_acquire))
+        Reserve(PROFILER_ARENA_SIZE);
+
+    if (base)
+    {
+        u64 at = used.load(std::memory_order_relaxed);
+        u64 aligned = (at + align - 1) & ~(align - 1);
+        while (aligned + bytes <= size &&
+               !used.compare_exchange_weak(at, aligned + bytes, std::memory_order_relaxed))
+            aligned = (at + align - 1) & ~(align - 1);
+
+        if (aligned + bytes <= size)
+            return base + aligned;
+    }
+
+    persist bool warned = false;
+    if (!warned && base)
+        WARN("Profiler arena full, raise PROFILER_ARENA_SIZE");
+    warned = true;
+
+    void *result = aligned_alloc(align, (bytes + align - 1) & ~(align - 1));
+    if (!result)
+    {
+        ERR("Couldn't allocate %llu bytes", bytes);
+        return nullptr;
+    }
+
+    memset(result, 0, bytes);
+    return result;
+}
+
+ProfilerArena ProfilerArena::_Arena = {};
+
+internal bool MatchesAny(StackArray<cstr, MAX_AUTO_FILTERS> &patterns, cstr name, cstr module, cstr file)
+{
+    for (cstr pattern : patterns)
+    {
+        if (strstr(name, pattern) || strstr(module, pattern) || strstr(file, pattern))
+            return true;
+    }
+    return false;
+}
+
+internal char *CopyToArena(cstr text)
+{
+    u64 len = strlen(text);
+    char *result = (char *)ProfilerArena::Get().Alloc(len + 1, 1);
+    if (!result)
+        return (char *)"";
+    memcpy(result, text, len + 1);
+    return result;
+}
+
+#define AUTO_PENDING ~0u
+
+u32 AutoInstrumentation::Resolve(void *function)
+{
+    if (MAX_AUTO_BLOCKS == 0)
+    {
+        persist std::atomic<bool> warned = false;
+        if (!warned.exchange(true, std::memory_order_relaxed))
+            WARN("Built with MAX_AUTO_BLOCKS 0, instrumented functions aren't timed");
+        return 0;
+    }
+
+    u64 mask = AUTO_BLOCK_SLOTS * 8 - 1;
+    u64 slot = (u64(function) * 0x9E3779B97F4A7C15ull >> 32) & mask;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (u64 probes = 0; table[slot].function; probes++, slot = (slot + 1) & mask)
+        {
+            if (table[slot].function == function)
+                break;
+
+            if (probes == mask)
+            {
+                persist bool warned = false;
+                if (!warned)
+                    WARN("Too many instrumented functions, raise MAX_AUTO_BLOCKS");
+                warned = true;
+                return 0;
+            }
+        }
+
+        if (!table[slot].function)
+        {
+            table[slot] = Entry{.function = function, .id = AUTO_PENDING};
+        }
+        else
+        {
+            // Another thread resolves it: wait for its decision, enter and exit must agree.
+            while (table[slot].id == AUTO_PENDING)
+            {
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+            }
+            return table[slot].id;
+        }
+    }
+
+    // The symbolizer also sees static functions and line tables; dladdr only sees exported symbols.
+    // Either may parse a module first, so the table stays unlocked meanwhile.
+    char name[256], module[256];
+    SymbolLocation location = {};
+    if (Symbolizer::Get().Resolve(function, &location))
+    {
+        snprintf(name, sizeof(name), "%s", location.function);
+        snprintf(module, sizeof(module), "%s", location.module);
+    }
+    else if (!ResolveSymbol(function, name, sizeof(name), module, sizeof(module)))
+    {
+        snprintf(name, sizeof(name), "%p", function);
+    }
+    cstr file = location.file ? location.file : "";
+
+    std::lock_guard<std::mutex> guard(lock);
+    u32 id = 0;
+    bool wanted = (include.len == 0 || MatchesAny(include, name, module, file)) &&
+                  !MatchesAny(exclude, name, module, file);
+    if (wanted && registered < MAX_AUTO_BLOCKS)
+    {
+        labels[registered] = CopyToArena(name);
+        files[registered] = CopyToArena(file[0] ? file : module);
+        lines[registered] = location.line;
+        id = MAX_BLOCKS + registered++;
+    }
+    else if (wanted)
+    {
+        persist bool warned = false;
+        if (!warned)
+            WARN("More than MAX_AUTO_BLOCKS (%d) instrumented functions, the rest aren't timed",
+                 MAX_AUTO_BLOCKS);
+        warned = true;
+    }
+
+    table[slot].id = id;
+    return id;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+
+// Direct mapped, per thread, so the common case is one load and compare.
+#define AUTO_CACHE_SIZE 256
+
+persist thread_local AutoInstrumentation::Entry autoCache[AUTO_CACHE_SIZE];
+persist thread_local u32 autoDepth = 0;
+persist thread_local bool inAutoHook = false;
+
+__attribute__((no_instrument_function)) internal u32 LookupAutoBlock(Profiler &profiler, void *function)
+{
+    AutoInstrumentation::Entry &entry = autoCache[(u64(function) >> 4) & (AUTO_CACHE_SIZE - 1)];
+    if (entry.function != function)
+    {
+        entry.function = function;
+        entry.id = profiler.autoBlocks.Resolve(function);
+    }
+    return entry.id;
+}
+
+// Inline profiler functions compiled into instrumented code call back in here, so the hooks
+// ignore anything that happens while they run.
+EXPORT __attribute__((no_instrument_function)) void __cyg_profile_func_enter(void *function, void *)
+{
+    Profiler &profiler = Profiler::Get();
+    if (inAutoHook || profiler.ended)
+        return;
+
+    inAutoHook = true;
+    if (++autoDepth <= profiler.autoBlocks.maxDepth)
+    {
+        u32 id = LookupAutoBlock(profiler, function);
+        if (id)
+        {
+            u32 index = id - MAX_BLOCKS;
+            profiler.BeginBlock(id,
+                                profiler.autoBlocks.labels[index],
+                                profiler.autoBlocks.files[index],
+                                profiler.autoBlocks.lines[index]);
+        }
+    }
+    inAutoHook = false;
+}
+
+EXPORT __attribute__((no_instrument_function)) void __cyg_profile_func_exit(void *function, void *)
+{
+    Profiler &profiler = Profiler::Get();
+    if (inAutoHook || profiler.ended)
+        return;
+
+    inAutoHook = true;
+    if (autoDepth-- <= profiler.autoBlocks.maxDepth && LookupAutoBlock(profiler, function))
+        profiler.EndBlock();
+    inAutoHook = false;
+}
+
+#endif
+
+internal void OnDumpSignal(int) { Profiler::Get().recorder.RequestDump(); }
+
+// Sleeps until a block end hands it a dump, so writing files never happens on a measured thread.
+internal void RunFlightDumps(FlightRecorder &recorder, u32 seen)
+{
+    for (;;)
+    {
+        recorder.wakeups.wait(seen, std::memory_order_acquire);
+        seen = recorder.wakeups.load(std::memory_order_acquire);
+        if (!recorder.dumping.load(std::memory_order_acquire))
+            return;
+
+        recorder.Dump();
+    }
+}
+
+void FlightRecorder::Start(u64 bytesPerThread, f64 windowSeconds, f64 thresholdSeconds, cstr _path)
+{
+    u64 events = 1024;
+    while (events * 2 * sizeof(TraceEvent) <= bytesPerThread)
+        events *= 2;
+
+    // The timebase never switches clocks, so the rings and the dump header agree with this.
+    freq = Timebase::Get().freq;
+    window = u64(windowSeconds * f64(freq));
+
+    // Reserves the arena here rather than on the first recorded event.
+    if (events > scratchEvents)
+    {
+        std::lock_guard<std::mutex> lock(ringsLock);
+        TraceEvent *grown = (TraceEvent *)ProfilerArena::Get().Alloc(events * sizeof(TraceEvent));
+        if (!grown)
+        {
+            ERR("Flight recorder not started");
+            return;
+        }
+        scratch = grown;
+        scratchEvents = events;
+    }
+    ringEvents = events;
+
+    threshold = u64(thresholdSeconds * f64(freq));
+    minDumpGap = freq;
+    path = _path;
+
+    persist bool installed = false;
+    if (!installed)
+        installed = InstallDumpSignal(OnDumpSignal);
+
+    if (!dumper.joinable())
+    {
+        dumping.store(true, std::memory_order_relaxed);
+        dumper = std::thread(RunFlightDumps, std::ref(*this), wakeups.load(std::memory_order_relaxed));
+    }
+
+    active.store(true, std::memory_order_relaxed);
+}
+
+// Rings stay allocated, other threads may still be writing to them.
+void FlightRecorder::Stop()
+{
+    active.store(false, std::memory_order_relaxed);
+    if (!dumper.joinable())
+        return;
+
+    dumping.store(false, std::memory_order_release);
+    wakeups.fetch_add(1, std::memory_order_release);
+    wakeups.notify_one();
+    dumper.join();
+}
+
+// Only the forking thread survives: drop the parent's dumper without joining it, and start one
+// for this process.
+void FlightRecorder::Forked()
+{
+    new (&dumper) std::thread();
+    if (!dumping.load(std::memory_order_relaxed))
+        return;
+
+    dumper = std::thread(RunFlightDumps, std::ref(*this), wakeups.load(std::memory_order_relaxed));
+}
+
+void FlightRecorder::Record(u32 kind, u32 id, u64 time, u64 value)
+{
+    persist thread_local TraceRing *ring = nullptr;
+    persist thread_local bool unavailable = false;
+    if (!ring)
+    {
+        // Out of memory: this thread just isn't recorded.
+        if (unavailable)
+            return;
+
+        ProfilerArena &arena = ProfilerArena::Get();
+        TraceRing *fresh = (TraceRing *)arena.Alloc(sizeof(TraceRing));
+        TraceEvent *events = fresh ? (TraceEvent *)arena.Alloc(ringEvents * sizeof(TraceEvent)) : nullptr;
+        if (!events)
+        {
+            unavailable = true;
+            return;
+        }
+
+        ring = fresh;
+        ring->events = events;
+        ring->mask = ringEvents - 1;
+        ring->thread = GetThreadID();
+
+        std::lock_guard<std::mutex> lock(ringsLock);
+        ring->next = rings;
+        rings = ring;
+    }
+
+    u64 head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head & ring->mask] = TraceEvent{.time = time, .value = value, .id = id, .kind = kind};
+    ring->head.store(head + 1, std::memory_order_release);
+
+    // One thread claims the request, and only one of those claims a dump per minDumpGap.
+    if (kind == TraceEnd && dumpRequested.load(std::memory_order_relaxed) &&
+        dumpRequested.exchange(false, std::memory_order_relaxed))
+    {
+        u64 last = lastDump.load(std::memory_order_relaxed);
+        if ((last == 0 || time - last >= minDumpGap) &&
+            lastDump.compare_exchange_strong(last, time, std::memory_order_relaxed))
+        {
+            wakeups.fetch_add(1, std::memory_order_release);
+            wakeups.notify_one();
+        }
+    }
+}
+
+internal void WriteTraceName(FILE *file, u32 kind, u32 id, cstr label, cstr fileName, i32 line)
+{
+    label = label ? label : "";
+    fileName = fileName ? fileName : "";
+
+    TraceName name = {
+        .kind = kind,
+        .id = id,
+        .line = u32(line),
+        .labelLen = u32(strlen(label)),
+        .fileLen = u32(strlen(fileName)),
+    };
+    fwrite(&name, sizeof(name), 1, file);
+    fwrite(label, 1, name.labelLen, file);
+    fwrite(fileName, 1, name.fileLen, file);
+}
+
+bool FlightRecorder::Dump(cstr file)
+{
+    u64 now = ReadTimer();
+
+    char generated[512];
+    if (!file)
+    {
+        snprintf(generated,
+                 sizeof(generated),
+                 "%s-%u-%u.trace",
+                 path ? path : "flight",
+                 GetProcessID(),
+                 dumps.fetch_add(1, std::memory_order_relaxed));
+        file = generated;
+    }
+
+    FILE *out = fopen(file, "wb");
+    if (!out)
+    {
+        ERR("Couldn't open %s", file);
+        return false;
+    }
+
+    Profiler &profiler = Profiler::Get();
+    TraceHeader header = {
+        .magic = {},
+        .version = TRACE_VERSION,
+        .freq = freq ? freq : Timebase::Get().freq, // Before any Start, the rings are empty
+        .start = profiler.start,
+    };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+    for (u64 i = 1; i < profiler.blocks.cap; i++)
+        header.names += profiler.blocks[i].iterations ? 1 : 0;
+    for (u64 i = 1; i < profiler.counters.cap; i++)
+        header.names += profiler.counters[i].total.count ? 1 : 0;
+    header.names += u32(profiler.flows.len);
+
+    std::lock_guard<std::mutex> lock(ringsLock);
+    for (TraceRing *ring = rings; ring; ring = ring->next)
+        header.threads++;
+
+    fwrite(&header, sizeof(header), 1, out);
+
+    persist SystemInfo info = SystemInfo::Query();
+    TraceSystem system = {
+        .platform = {},
+        .architecture = {},
+        .processors = info.numberOfProcessors,
+        .pageSize = info.pageSize,
+        .majorVersion = info.majorVersion,
+        .minorVersion = info.minorVersion,
+        .buildNumber = info.buildNumber,
+        .pad = 0,
+        .cpuTimerFreq = Timebase::Get().cpuTimerFreq,
+        .totalPhys = info.totalPhys,
+    };
+    snprintf(system.platform, sizeof(system.platform), "%s", info.platformName);
+    snprintf(system.architecture, sizeof(system.architecture), "%s", info.processorArchitecture);
+    fwrite(&system, sizeof(system), 1, out);
+
+    for (u64 i = 1; i < profiler.blocks.cap; i++)
+    {
+        Block &block = profiler.blocks[i];
+        if (block.iterations)
+            WriteTraceName(out, TraceNameBlock, u32(i), block.label, block.file, block.line);
+    }
+    for (u64 i = 0; i < profiler.flows.len; i++)
+        WriteTraceName(out, TraceNameFlow, u32(i), profiler.flows[i].label, "", 0);
+    for (u64 i = 1; i < profiler.counters.cap; i++)
+    {
+        Counter &counter = profiler.counters[i];
+        if (counter.total.count)
+            WriteTraceName(out, TraceNameCounter, u32(i), counter.label, counter.file, counter.line);
+    }
+
+    // The scratch buffer only grows, so every ring fits.
+    TraceEvent *copy = scratch;
+    for (TraceRing *ring = rings; ring; ring = ring->next)
+    {
+        u64 size = ring->mask + 1;
+
+        // The owner keeps writing while we copy: drop whatever it may have overwritten meanwhile.
+        u64 head = ring->head.load(std::memory_order_acquire);
+        u64 from = head > size ? head - size : 0;
+        for (u64 i = from; i < head; i++)
+            copy[i - from] = ring->events[i & ring->mask];
+
+        u64 after = ring->head.load(std::memory_order_acquire);
+        u64 valid = after > size ? after - size : 0;
+        u64 skip = valid > from ? valid - from : 0;
+        while (window && skip < head - from && copy[skip].time + window < now)
+            skip++;
+
+        TraceThread stream = {
+            .thread = ring->thread,
+            .pad = 0,
+            .events = skip < head - from ? head - from - skip : 0,
+        };
+        fwrite(&stream, sizeof(stream), 1, out);
+        fwrite(copy + skip, sizeof(TraceEvent), stream.events, out);
+    }
+
+    fclose(out);
+
+    lastDump.store(now, std::memory_order_relaxed);
+    INFO("Flight recorder dumped to %s", file);
+    return true;
+}
+
+AsyncScope::AsyncScope(u64 id, cstr label, cstr file, i32 line)
+    : block{nullptr}, wallFrom{ReadTimer()}, cpuFrom{0}, cpuPaused{0}, cpuTime{0}, suspensions{0},
+      migrations{0}, thread{GetThreadID()}, suspended{false},
+      trackCPUTime{Profiler::Get().trackCPUTime}
+{
+    Profiler &profiler = Profiler::Get();
+    if (id >= profiler.asyncBlocks.cap)
+    {
+        return;
+    }
+
+    block = &profiler.asyncBlocks[id];
+    block->label = label;
+    block->file = file;
+    block->line = line;
+    if (trackCPUTime)
+        cpuFrom = ReadThreadCPUTime();
+}
+
+// Only pauses the clock: the suspension counts once the coroutine is resumed or destroyed, since
+// await_suspend may still decide not to suspend.
+void AsyncScope::Suspend()
+{
+    if (trackCPUTime)
+        cpuPaused = ReadThreadCPUTime();
+    suspended = true;
+}
+
+// await_suspend returned false, so the coroutine carries on as if it never paused.
+void AsyncScope::Continue() { suspended = false; }
+
+void AsyncScope::Resume()
+{
+    // await_resume also runs when await_ready short-circuits, without a prior suspension.
+    if (!suspended)
+        return;
+
+    suspended = false;
+    suspensions++;
+    if (trackCPUTime)
+    {
+        cpuTime += cpuPaused - cpuFrom;
+        cpuFrom = ReadThreadCPUTime();
+    }
+
+    u32 now = GetThreadID();
+    if (now != thread)
+    {
+        migrations++;
+        thread = now;
+    }
+}
+
+AsyncScope::~AsyncScope()
+{
+    if (!block)
+        return;
+
+    // Destroyed while suspended means the coroutine was cancelled; nothing ran since Suspend().
+    if (suspended)
+        suspensions++;
+    if (trackCPUTime)
+        cpuTime += (suspended ? cpuPaused : ReadThreadCPUTime()) - cpuFrom;
+
+    block->iterations.fetch_add(1, std::memory_order_relaxed);
+    block->wallTime.fetch_add(ReadTimer() - wallFrom, std::memory_order_relaxed);
+    block->cpuTime.fetch_add(cpuTime, std::memory_order_relaxed);
+    block->suspensions.fetch_add(suspensions, std::memory_order_relaxed);
+    block->migrations.fetch_add(migrations, std::memory_order_relaxed);
+}
+
+internal u32 Log2(u64 value)
+{
+    if (value == 0)
+        return 0;
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return u32(index);
+#else
+    return 63 - u32(__builtin_clzll(value));
+#endif
+}
+
+void Histogram::Add(u64 value)
+{
+    buckets[Log2(value)].fetch_add(1, std::memory_order_relaxed);
+}
+
+u64 Histogram::Count() const
+{
+    u64 result = 0;
+    for (auto &bucket : buckets)
+        result += bucket.load(std::memory_order_relaxed);
+    return result;
+}
+
+// Returns the midpoint of the bucket holding the p-th fraction of samples.
+u64 Histogram::Percentile(f64 p) const
+{
+    u64 count = Count();
+    if (count == 0)
+        return 0;
+
+    u64 target = u64(ceil(p * f64(count)));
+    u64 seen = 0;
+    for (u32 i = 0; i < 64; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target && seen > 0)
+            return i == 0 ? 1 : (1ull << i) + (1ull << (i - 1));
+    }
+
+    return ~0ull;
+}
+
+internal void CPUPause()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+void Flow::Begin(u64 id)
+{
+    Pending &slot = pending[id & (MAX_PENDING_FLOWS - 1)];
+    u64 evicted = slot.key.load(std::memory_order_relaxed);
+    while (evicted == FLOW_BUSY ||
+           !slot.key.compare_exchange_weak(evicted, FLOW_BUSY, std::memory_order_acquire))
+    {
+        if (evicted == FLOW_BUSY)
+        {
+            CPUPause();
+            evicted = slot.key.load(std::memory_order_relaxed);
+        }
+    }
+    if (evicted != 0 && evicted != id + 1)
+        dropped.fetch_add(1, std::memory_order_relaxed);
+
+    u64 now = ReadTimer();
+    slot.from.store(now, std::memory_order_relaxed);
+    slot.thread.store(GetThreadID(), std::memory_order_relaxed);
+    slot.key.store(id + 1, std::memory_order_release);
+
+    FlightRecorder &recorder = Profiler::Get().recorder;
+    if (recorder.active.load(std::memory_order_relaxed))
+        recorder.Record(TraceFlowBegin, u32(this - &Profiler::Get().flows[0]), now, id);
+}
+
+void Flow::End(u64 id)
+{
+    u64 now = ReadTimer();
+
+    FlightRecorder &recorder = Profiler::Get().recorder;
+    if (recorder.active.load(std::memory_order_relaxed))
+        recorder.Record(TraceFlowEnd, u32(this - &Profiler::Get().flows[0]), now, id);
+
+    Pending &slot = pending[id & (MAX_PENDING_FLOWS - 1)];
+    u64 key = id + 1;
+    if (slot.key.load(std::memory_order_acquire) != key)
+        return;
+
+    if (!slot.key.compare_exchange_strong(key, FLOW_BUSY, std::memory_order_acquire))
+        return;
+
+    u64 from = slot.from.load(std::memory_order_relaxed);
+    u32 thread = slot.thread.load(std::memory_order_relaxed);
+    slot.key.store(0, std::memory_order_release);
+
+    u64 elapsed = now > from ? now - from : 0;
+    count.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(elapsed, std::memory_order_relaxed);
+    if (thread != GetThreadID())
+        crossThread.fetch_add(1, std::memory_order_relaxed);
+
+    u64 prev = min.load(std::memory_order_relaxed);
+    while ((prev == 0 || elapsed < prev) &&
+           !min.compare_exchange_weak(prev, elapsed, std::memory_order_relaxed))
+    {
+    }
+
+    prev = max.load(std::memory_order_relaxed);
+    while (elapsed > prev && !max.compare_exchange_weak(prev, elapsed, std::memory_order_relaxed))
+    {
+    }
+
+    latency.Add(elapsed);
+}
+
+Flow *Profiler::GetFlow(cstr label)
+{
+    std::lock_guard<std::mutex> lock(flowsLock);
+
+    for (u64 i = 0; i < flows.len; i++)
+    {
+        if (strcmp(flows[i].label, label) == 0)
+            return &flows[i];
+    }
+
+    if (flows.len >= flows.cap)
+    {
+        WARN("MAX_FLOWS exceeded, ignoring flow %s", label);
+        return nullptr;
+    }
+
+    Flow *flow = &flows[flows.len++];
+    flow->label = label;
+    return flow;
+}
+
+void Spinlock::lock()
+{
+    while (locked.exchange(true, std::memory_order_acquire))
+    {
+        while (locked.load(std::memory_order_relaxed))
+            CPUPause();
+    }
+}
+
+void LockStats::Merge(const LockStats &other)
+{
+    acquisitions += other.acquisitions;
+    contended += other.contended;
+    waitTotal += other.waitTotal;
+    waitMax = waitMax > other.waitMax ? waitMax : other.waitMax;
+    holdTotal += other.holdTotal;
+    holdMax = holdMax > other.holdMax ? holdMax : other.holdMax;
+    sharedAcquisitions += other.sharedAcquisitions;
+    sharedContended += other.sharedContended;
+    sharedWaitTotal += other.sharedWaitTotal;
+    sharedWaitMax = sharedWaitMax > other.sharedWaitMax ? sharedWaitMax : other.sharedWaitMax;
+}
+
+internal void MergeLockStats(StackArray<LockStats, MAX_LOCKS> &into, const LockStats &stats)
+{
+    for (u64 i = 0; i < into.len; i++)
+    {
+        if (strcmp(into[i].label, stats.label) == 0)
+        {
+            into[i].Merge(stats);
+            return;
+        }
+    }
+
+    if (into.len >= into.cap)
+    {
+        WARN("MAX_LOCKS exceeded, ignoring lock %s", stats.label);
+        return;
+    }
+
+    into[into.len++] = stats;
+}
+
+ProfiledLockBase::ProfiledLockBase(cstr label)
+    : stats{.label = label}, acquired{0}, sharedAcquisitions{0}, sharedContended{0},
+      sharedWaitTotal{0}, sharedWaitMax{0}, registered{false}, prev{nullptr}, next{nullptr}
+{
+}
+
+ProfiledLockBase::~ProfiledLockBase()
+{
+    if (!registered.load(std::memory_order_relaxed))
+        return;
+
+    Profiler &profiler = Profiler::Get();
+    std::lock_guard<std::mutex> lock(profiler.locksLock);
+
+    if (prev)
+        prev->next = next;
+    else
+        profiler.liveLocks = next;
+    if (next)
+        next->prev = prev;
+
+    MergeLockStats(profiler.retiredLocks, Snapshot());
+}
+
+void ProfiledLockBase::Register()
+{
+    Profiler &profiler = Profiler::Get();
+    std::lock_guard<std::mutex> lock(profiler.locksLock);
+
+    // Shared holders can race here, exclusive ones already hold the lock.
+    if (registered.load(std::memory_order_relaxed))
+        return;
+
+    next = profiler.liveLocks;
+    if (next)
+        next->prev = this;
+    profiler.liveLocks = this;
+    registered.store(true, std::memory_order_relaxed);
+}
+
+LockStats ProfiledLockBase::Snapshot() const
+{
+    LockStats result = stats;
+    result.sharedAcquisitions = sharedAcquisitions.load(std::memory_order_relaxed);
+    result.sharedContended = sharedContended.load(std::memory_order_relaxed);
+    result.sharedWaitTotal = sharedWaitTotal.load(std::memory_order_relaxed);
+    result.sharedWaitMax = sharedWaitMax.load(std::memory_order_relaxed);
+    return result;
+}
+
+void ProfiledLockBase::SharedAcquired(u64 wait, bool contended)
+{
+    if (!registered.load(std::memory_order_relaxed))
+        Register();
+
+    sharedAcquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (!contended)
+        return;
+
+    sharedContended.fetch_add(1, std::memory_order_relaxed);
+    sharedWaitTotal.fetch_add(wait, std::memory_order_relaxed);
+
+    u64 prev = sharedWaitMax.load(std::memory_order_relaxed);
+    while (wait > prev &&
+           !sharedWaitMax.compare_exchange_weak(prev, wait, std::memory_order_relaxed))
+    {
+    }
+}
+
+static f64 ToGb(f64 bytes)
+{
+    return bytes / 1024.0 / 1024.0 / 1024.0;
+}
+
+void Profiler::End()
+{
+    if (ended)
+        return;
+
+    ended = true;
+    Initialized = false;
+    budgets.Stop();
+    recorder.Stop();
+    SystemInfo::EndBenchmark();
+
+    if (fleet.IsWorker())
+    {
+        fleet.Publish();
+        return;
+    }
+
+    u64 perfCounter = ReadTimer();
+    u64 perfFreq = Timebase::Get().freq;
+
+    f64 totalTime = f64(perfCounter - start) / f64(perfFreq);
+
+    Timebase::Get().Print();
+    INFO("Finished %s in %.6f seconds", name, totalTime);
+
+    ProfilerArena &arena = ProfilerArena::Get();
+    if (arena.reserved.load(std::memory_order_acquire))
+        INFO("Profiler arena: %.2f of %.2f MB used, %s",
+             f64(arena.used.load(std::memory_order_relaxed)) / 1024.0 / 1024.0,
+             f64(arena.size) / 1024.0 / 1024.0,
+             arena.largePages ? "huge pages" : "normal pages");
+    printf(" %-24s \t| %-25s \t| %-25s \t| %-12s\n",
+           "Name[n]",
+           "Time (Ex)",
+           "Time (Inc)",
+           "Bandwidth");
+    printf(
+        "-----------------------------------------------------------------------------------"
+        "--------------------"
+        "--------\n");
+
+    for (u64 i = 1; i < blocks.cap; i++)
+    {
+        auto next = blocks[i];
+        if (next.iterations == 0)
+            continue;
+
+        // Ratio estimate for sampled blocks, minus the time of sampled children that ran untimed.
+        f64 scale = f64(next.iterations) / f64(next.samples);
+        f64 timeEx = (f64(next.timeEx) - f64(next.overcount)) * scale;
+        f64 nextTimeEx = (timeEx > 0 ? timeEx : 0) / f64(perfFreq);
+        f64 nextTimeInc = f64(next.timeInc) * scale / f64(perfFreq);
+        next.bytesProcessed = u64(f64(next.bytesProcessed) * scale);
+        if (next.bytesProcessed == 0)
+        {
+            printf(" %-20s [%llu] \t| %.5f secs\t(%.2f%%) \t| %.5f secs\t(%.2f%%) \t|\n",
+                   next.label,
+                   next.iterations,
+                   nextTimeEx,
+                   (nextTimeEx / totalTime) * 100,
+                   nextTimeInc,
+                   (nextTimeInc / totalTime) * 100);
+        }
+        else
+        {
+            printf(
+                " %-20s [%llu] \t| %.5f secs\t(%.2f%%) \t| %.5f secs\t(%.2f%%) \t| %.3f GB/s\n",
+                next.label,
+                next.iterations,
+                nextTimeEx,
+                (nextTimeEx / totalTime) * 100,
+                nextTimeInc,
+                (nextTimeInc / totalTime) * 100,
+                f64(next.bytesProcessed) / nextTimeEx / 1024.0 / 1024.0 / 1024.0);
+        }
+    }
+
+    bool anyExemplar = false;
+    for (u64 i = 1; i < blocks.cap; i++)
+    {
+        Block &next = blocks[i];
+        if (next.slowestLen == 0)
+            continue;
+
+        if (!anyExemplar)
+        {
+            anyExemplar = true;
+            INFO("Slowest executions");
+        }
+
+        Exemplar sorted[MAX_EXEMPLARS];
+        memcpy(sorted, next.slowest, sizeof(Exemplar) * next.slowestLen);
+        qsort(sorted, next.slowestLen, sizeof(Exemplar), BySlowest);
+
+        printf(" %-20s", next.label);
+        for (u32 j = 0; j < next.slowestLen; j++)
+        {
+            Exemplar &exemplar = sorted[j];
+            printf("%s\t> %.3f ms \tat +%.6fs \tthread %u \t%llu bytes",
+                   j == 0 ? "" : "                     ",
+                   f64(exemplar.duration) / f64(perfFreq) * 1000.0,
+                   f64(i64(exemplar.start - start)) / f64(perfFreq),
+                   exemplar.thread,
+                   exemplar.bytes);
+            if (exemplar.tag)
+                printf(" \ttag %llu", exemplar.tag);
+            printf("\n");
+        }
+    }
+
+    bool anyBudget = false;
+    for (u64 i = 1; i < blocks.cap; i++)
+    {
+        Block &next = blocks[i];
+        if (!next.budget || next.iterations == 0)
+            continue;
+
+        if (!anyBudget)
+        {
+            anyBudget = true;
+            INFO("Latency budgets");
+            printf(" %-24s \t| %-12s \t| %-12s \t| %-10s \t| %-12s\n",
+                   "Name[n]",
+                   "Budget",
+                   "Violations",
+                   "Rate",
+                   "Worst");
+            printf("-----------------------------------------------------------------------------------"
+                   "--------------------\n");
+        }
+
+        u64 worst = 0;
+        for (u32 j = 0; j < next.slowestLen; j++)
+            worst = next.slowest[j].duration > worst ? next.slowest[j].duration : worst;
+
+        // Sampled budget blocks aren't supported, so samples is the execution count.
+        f64 rate = 100.0 * f64(next.violations) / f64(next.samples);
+        printf(" %-20s [%llu] \t| %8.3f ms \t| %-12llu \t| %6.2f%% \t| %8.3f ms\n",
+               next.label,
+               next.samples,
+               f64(next.budget) / f64(perfFreq) * 1000.0,
+               next.violations,
+               rate,
+               f64(worst) / f64(perfFreq) * 1000.0);
+    }
+
+    bool splitCPU = trackCPUTime;
+    for (u64 i = 1; i < blocks.cap && !splitCPU; i++)
+        splitCPU = blocks[i].splitCPU && blocks[i].iterations;
+
+    if (splitCPU)
+    {
+        INFO("CPU time");
+        printf(" %-24s \t| %-12s \t| %-20s \t| %-12s\n",
+               "Name[n]",
+               "Wall (Ex)",
+               "CPU (Ex)",
+               "Off-CPU (Ex)");
+        printf(
+            "-----------------------------------------------------------------------------------"
+            "--------------------"
+            "--------\n");
+
+        for (u64 i = 1; i < blocks.cap; i++)
+        {
+            auto next = blocks[i];
+            if (next.iterations == 0 || !(trackCPUTime || next.splitCPU))
+                continue;
+
+            // Scaled like the main table, so sampled blocks agree with it.
+            f64 scale = f64(next.iterations) / f64(next.samples);
+            f64 timeEx = (f64(next.timeEx) - f64(next.overcount)) * scale;
+            f64 wall = (timeEx > 0 ? timeEx : 0) / f64(perfFreq);
+            f64 cpu = f64(next.cpuEx) * scale / 1e9;
+            f64 offCPU = wall > cpu ? wall - cpu : 0.0;
+            printf(" %-20s [%llu] \t| %.5f secs \t| %.5f secs\t(%.2f%%) \t| %.5f secs\n",
+                   next.label,
+                   next.iterations,
+                   wall,
+                   cpu,
+                   wall > 0 ? (cpu / wall) * 100 : 0.0,
+                   offCPU);
+        }
+    }
+
+    if (flows.len > 0)
+    {
+        INFO("Flows (handoff latency)");
+        printf(" %-24s \t| %-10s \t| %-10s \t| %-10s \t| %-10s \t| %-10s \t| %-8s \t| %-8s\n",
+               "Name[n]",
+               "Avg",
+               "Min",
+               "p50",
+               "p99",
+               "Max",
+               "Cross",
+               "Dropped");
+        printf(
+            "-----------------------------------------------------------------------------------"
+            "--------------------"
+            "--------\n");
+
+        f64 toUs = 1e6 / f64(perfFreq);
+        for (Flow &next : flows)
+        {
+            u64 count = next.count.load(std::memory_order_relaxed);
+            printf(" %-20s [%llu] \t| %.2f us \t| %.2f us \t| %.2f us \t| %.2f us \t| %.2f us \t| %-8llu "
+                   "\t| %-8llu\n",
+                   next.label,
+                   count,
+                   count ? f64(next.total.load(std::memory_order_relaxed)) / f64(count) * toUs : 0.0,
+                   f64(next.min.load(std::memory_order_relaxed)) * toUs,
+                   f64(next.latency.Percentile(0.50)) * toUs,
+                   f64(next.latency.Percentile(0.99)) * toUs,
+                   f64(next.max.load(std::memory_order_relaxed)) * toUs,
+                   next.crossThread.load(std::memory_order_relaxed),
+                   next.dropped.load(std::memory_order_relaxed));
+        }
+    }
+
+    if (trackPlacement)
+    {
+        INFO("Placement");
+        printf(" %-24s \t| %-18s", "Name[n]", "Migrations");
+        for (u32 node = 0; node < numaNodes; node++)
+            printf(" \t| Node %-2u (time, bw)    ", node);
+        printf("\n");
+        printf(
+            "-----------------------------------------------------------------------------------"
+            "--------------------"
+            "--------\n");
+
+        for (u64 i = 1; i < blocks.cap; i++)
+        {
+            Block &next = blocks[i];
+            if (next.iterations == 0)
+                continue;
+
+            // Node shares and bandwidths are ratios, unaffected by sampling; the count isn't.
+            printf(" %-20s [%llu] \t| %-8llu (%.2f%%)",
+                   next.label,
+                   next.iterations,
+                   u64(f64(next.migrations) * f64(next.iterations) / f64(next.samples)),
+                   f64(next.migrations) / f64(next.samples) * 100);
+
+            for (u32 node = 0; node < numaNodes; node++)
+            {
+                f64 nodeTime = f64(next.nodeTimeEx[node]) / f64(perfFreq);
+                f64 share = next.timeEx ? f64(next.nodeTimeEx[node]) / f64(next.timeEx) * 100 : 0.0;
+                printf(" \t| %6.2f%%  %8.3f GB/s",
+                       share,
+                       nodeTime > 0 ? ToGb(f64(next.nodeBytes[node]) / nodeTime) : 0.0);
+            }
+            printf("\n");
+        }
+    }
+
+    StackArray<LockStats, MAX_LOCKS> locks = {};
+    {
+        std::lock_guard<std::mutex> lock(locksLock);
+        for (const LockStats &retired : retiredLocks)
+            MergeLockStats(locks, retired);
+        for (ProfiledLockBase *live = liveLocks; live; live = live->next)
+            MergeLockStats(locks, live->Snapshot());
+    }
+
+    if (locks.len > 0)
+    {
+        INFO("Locks");
+        printf(" %-24s \t| %-18s \t| %-10s \t| %-10s \t| %-10s \t| %-10s \t| %-18s\n",
+               "Name[n]",
+               "Contended",
+               "Wait (avg)",
+               "Wait (max)",
+               "Hold (avg)",
+               "Hold (max)",
+               "Shared[n] (cont.)");
+        printf(
+            "-----------------------------------------------------------------------------------"
+            "--------------------"
+            "--------\n");
+
+        f64 toUs = 1e6 / f64(perfFreq);
+        for (const LockStats &next : locks)
+        {
+            printf(" %-20s [%llu] \t| %-8llu (%.2f%%) \t| %.2f us \t| %.2f us \t| %.2f us \t| %.2f us "
+                   "\t| %llu (%llu)\n",
+                   next.label,
+                   next.acquisitions,
+                   next.contended,
+                   next.acquisitions ? f64(next.contended) / f64(next.acquisitions) * 100 : 0.0,
+                   next.contended ? f64(next.waitTotal) / f64(next.contended) * toUs : 0.0,
+                   f64(next.waitMax) * toUs,
+                   next.acquisitions ? f64(next.holdTotal) / f64(next.acquisitions) * toUs : 0.0,
+                   f64(next.holdMax) * toUs,
+                   next.sharedAcquisitions,
+                   next.sharedContended);
+        }
+    }
+
+    bool anyCounter = false;
+    for (u64 i = 1; i < counters.cap; i++)
+    {
+        Counter &next = counters[i];
+        if (next.total.count == 0)
+            continue;
+
+        if (!anyCounter)
+        {
+            anyCounter = true;
+            INFO("Counters");
+            printf(" %-24s \t| %-12s \t| %-12s \t| %-12s \t| %-12s\n",
+                   "Name[n]",
+                   "Min",
+                   "Max",
+                   "Mean",
+                   "Last");
+            printf(
+                "-----------------------------------------------------------------------------------"
+                "--------------------"
+                "--------\n");
+        }
+
+        printf(" %-20s [%llu] \t| %-12.4g \t| %-12.4g \t| %-12.4g \t| %-12.4g\n",
+               next.label,
+               next.total.count,
+               next.total.min,
+               next.total.max,
+               next.total.sum / f64(next.total.count),
+               next.total.last);
+
+        if (counterInterval == 0)
+            continue;
+
+        // Oldest retained interval first, then the one still open.
+        u64 retained = next.intervals < MAX_COUNTER_INTERVALS ? next.intervals : MAX_COUNTER_INTERVALS;
+        for (u64 j = 0; j <= retained; j++)
+        {
+            CounterInterval &interval =
+                j < retained ? next.history[(next.intervals - retained + j) % MAX_COUNTER_INTERVALS]
+                             : next.current;
+            if (interval.count == 0)
+                continue;
+
+            printf("\t> +%.3fs \t| %-12.4g \t| %-12.4g \t| %-12.4g \t| %-12.4g\n",
+                   f64(interval.from - start) / f64(perfFreq),
+                   interval.min,
+                   interval.max,
+                   interval.sum / f64(interval.count),
+                   interval.last);
+        }
+    }
+
+    bool anyAsync = false;
+    for (u64 i = 1; i < asyncBlocks.cap; i++)
+    {
+        AsyncBlock &next = asyncBlocks[i];
+        u64 iterations = next.iterations.load(std::memory_order_relaxed);
+        if (iterations == 0)
+            continue;
+
+        if (!anyAsync)
+        {
+            anyAsync = true;
+            INFO("Async blocks");
+            printf(" %-24s \t| %-12s \t| %-12s \t| %-12s \t| %-10s \t| %-10s\n",
+                   "Name[n]",
+                   "Wall",
+                   "CPU",
+                   "Off-CPU",
+                   "Suspends",
+                   "Migrations");
+            printf(
+                "-----------------------------------------------------------------------------------"
+                "--------------------"
+                "--------\n");
+        }
+
+        f64 wall = f64(next.wallTime.load(std::memory_order_relaxed)) / f64(perfFreq);
+        f64 cpu = f64(next.cpuTime.load(std::memory_order_relaxed)) / 1e9;
+        printf(" %-20s [%llu] \t| %.5f secs \t| ", next.label, iterations, wall);
+        if (trackCPUTime)
+            printf("%.5f secs \t| %.5f secs \t| ", cpu, wall > cpu ? wall - cpu : 0.0);
+        else
+            printf("%-12s \t| %-12s \t| ", "-", "-");
+        printf("%-10llu \t| %-10llu\n",
+               next.suspensions.load(std::memory_order_relaxed),
+               next.migrations.load(std::memory_order_relaxed));
+    }
+
+    if (fleet.header)
+        PrintFleetReport(fleet.header);
+}
+
+Profiler::~Profiler()
+{
+    if (!Initialized)
+    {
+        Initialized = true;
+        return;
+    }
+    if (start != 0)
+        End();
+}
+
+Profiler Profiler::_Profiler = {};
+bool Profiler::Initialized = false;
+
+extern "C"
+{
+    i32 ByTime(const void *from, const void *to)
+    {
+        return ((RepBlock *)(from))->time - ((RepBlock *)(to))->time;
+    }
+
+    i32 ByBytes(const void *from, const void *to)
+    {
+        return ((RepBlock *)(from))->bytes - ((RepBlock *)(to))->bytes;
+    }
+
+    i32 ByPageFaults(const void *from, const void *to)
+    {
+        return ((RepBlock *)(from))->pageFaults - ((RepBlock *)(to))->pageFaults;
+    }
 }
 
-void Profiler::BeginBlock(u64 id, cstr label, cstr file, i32 line, u64 bytesProcessed)
+// Environment of the last InitBenchmark, printed with every RepProfiler report.
+persist SystemInfo benchmarkInfo = {};
+
+// Spins on the timer for 100ms. Any gap over NOISE_GAP_NS is time the thread didn't run:
+// interrupts, preemption, SMIs, or a hypervisor.
+internal void MeasureNoise(SystemInfo &info)
 {
-    if (id >= blocks.cap)
+    Timebase &timebase = Timebase::Get();
+    u64 gapTicks = u64(f64(NOISE_GAP_NS) * 1e-9 * f64(timebase.freq));
+    u64 duration = timebase.freq / 10;
+
+    u64 begin = ReadTimer();
+    u64 last = begin, lost = 0, maxGap = 0, interruptions = 0;
+    while (last - begin < duration)
     {
-        return;
+        u64 now = ReadTimer();
+        u64 gap = now - last;
+        if (gap > gapTicks)
+        {
+            interruptions++;
+            lost += gap;
+            maxGap = gap > maxGap ? gap : maxGap;
+        }
+        last = now;
     }
 
-    Block *m = &blocks[id];
-    LARGE_INTEGER time;
-    QueryPerformanceCounter(&time);
+    f64 elapsed = timebase.ToSeconds(last - begin);
+    info.interruptions = u32(f64(interruptions) / elapsed);
+    info.maxGapUs = timebase.ToNs(maxGap) / 1000.0;
+    info.lostPercent = timebase.ToSeconds(lost) / elapsed * 100.0;
+}
+
+SystemInfo SystemInfo::InitBenchmark(i32 cpu, bool raisePriority)
+{
+    // First: measuring the skew moves the thread across every CPU.
+    Timebase::Calibrate();
+    SystemInfo result = SystemInfo::Init();
+    result.benchmark = true;
+    result.pinnedCPU = -1;
+
+    if (cpu >= 0)
+    {
+        if (PinThreadToCPU(u32(cpu)))
+            result.pinnedCPU = cpu;
+        else
+            WARN("Couldn't pin the thread to CPU %d", cpu);
+    }
 
-    if (queue.len > 0)
+    if (raisePriority)
     {
-        Block *prev = &blocks[queue.Last()];
-        prev->timeEx += time.QuadPart - prev->from;
-        prev->timeInc += time.QuadPart - prev->from;
+        result.raisedPriority = RaiseThreadPriority();
+        if (!result.raisedPriority)
+            WARN("Couldn't raise the thread priority (needs CAP_SYS_NICE or admin)");
     }
 
-    m->from = time.QuadPart;
-    m->label = label;
-    m->file = file;
-    m->line = line;
-    m->bytesProcessed += bytesProcessed;
+    u32 node;
+    u32 current = result.pinnedCPU >= 0 ? u32(result.pinnedCPU) : GetCurrentCPU(&node);
+    ReadFrequencyPolicy(current, result.governor, sizeof(result.governor), &result.turbo);
+    result.smtSiblings = CountSMTSiblings(current);
+    MeasureNoise(result);
 
-    queue.Push(id);
+    result.PrintBenchmark();
 
-    m->iterations++;
+    if (result.pinnedCPU < 0)
+        WARN("Thread isn't pinned, the scheduler may migrate it between reps");
+    if (result.governor[0] && strcmp(result.governor, "performance") != 0)
+        WARN("CPU %u uses the %s governor, its frequency will vary", current, result.governor);
+    if (result.turbo == 1)
+        WARN("Turbo is enabled, results depend on temperature and load on other cores");
+    if (result.smtSiblings > 1)
+        WARN("CPU %u shares its core with %u other logical CPUs, keep them idle",
+             current,
+             result.smtSiblings - 1);
+    if (result.lostPercent > 1.0)
+        WARN("%.2f%% of the time went to other work, results will be noisy", result.lostPercent);
 
-    return;
+    benchmarkInfo = result;
+    return result;
 }
 
-void Profiler::AddBytes(u64 bytes) { blocks[queue.Last()].bytesProcessed += bytes; }
-
-Profiler::BlockFlag
-Profiler::BeginScopeBlock(i32 id, cstr label, cstr file, i32 line, u64 bytesProcessed)
+void SystemInfo::EndBenchmark()
 {
-    BeginBlock(id, label, file, line, bytesProcessed);
-    return BlockFlag{.parent = this};
+    if (!benchmarkInfo.benchmark)
+        return;
+
+    ResetThreadPriority();
+    ResetThreadAffinity();
+    benchmarkInfo.benchmark = false;
 }
 
-void Profiler::EndBlock()
+RepProfiler RepProfiler::New(cstr name, u64 maxRepeats, RepCacheMode cacheMode)
 {
-    LARGE_INTEGER now;
-    QueryPerformanceCounter(&now);
+    Timebase::Calibrate();
+    return RepProfiler{
+        .name = name,
+        .warm = {},
+        .cold = {},
+        .current = {},
+        .repeats = 0,
+        .maxRepeats = maxRepeats,
+        .counters = PerfCounters::Open(),
+        .cacheMode = cacheMode,
+        .workingSet = {},
+        .inner = {},
+    };
+}
 
-    Block *m = &blocks[queue.Pop()];
-    m->timeEx += now.QuadPart - m->from;
-    m->timeInc += now.QuadPart - m->from;
+void RepMatrix::Add(u64 id, u64 duration)
+{
+    u64 column = 0;
+    while (column < ids.len && ids[column] != id)
+        column++;
 
-    if (queue.len > 0)
+    if (column == ids.len)
     {
-        Block *prev = &blocks[queue.Last()];
-        prev->from = now.QuadPart;
-        prev->timeInc += now.QuadPart - m->from;
+        if (ids.len == ids.cap)
+        {
+            persist bool warned = false;
+            if (!warned)
+                WARN("More than MAX_REP_INNER_BLOCKS (%d) blocks in a rep, the rest aren't broken down",
+                     MAX_REP_INNER_BLOCKS);
+            warned = true;
+            return;
+        }
+        ids.Push(id);
     }
+
+    staged[column + 1] += duration;
 }
 
-void Profiler::End()
+// Rep bodies without inner blocks never get here with ids, so they reserve nothing.
+void RepMatrix::Commit(u64 rep, u64 time, u64 maxRepeats)
 {
-    if (ended)
+    if (ids.len == 0)
         return;
 
-    ended = true;
-    Initialized = false;
+    if (!cells && !failed)
+    {
+        first = rep;
+        rows = maxRepeats - rep < MAX_REP_MATRIX_REPS ? maxRepeats - rep : MAX_REP_MATRIX_REPS;
+        columns = MAX_REP_INNER_BLOCKS + 1;
 
-    LARGE_INTEGER perfCounter, perfFreq;
-    QueryPerformanceCounter(&perfCounter);
-    QueryPerformanceFrequency(&perfFreq);
+        bool largePages;
+        cells = (u64 *)ReserveMemory(rows * columns * sizeof(u64), false, &largePages);
+        failed = !cells;
+        if (failed)
+            ERR("Couldn't reserve the per rep block matrix, inner blocks won't be reported");
+    }
 
-    f64 totalTime =
-        f64(perfCounter.QuadPart - start) / f64(perfFreq.QuadPart);
+    if (cells && rep - first < rows)
+    {
+        staged[0] = time;
+        memcpy(Row(rep), staged, sizeof(staged));
+    }
+    memset(staged, 0, sizeof(staged));
+}
 
-    INFO("Finished %s in %.6f seconds", name, totalTime);
-    printf(" %-24s \t| %-25s \t| %-25s \t| %-12s\n",
-           "Name[n]",
-           "Time (Ex)",
-           "Time (Inc)",
-           "Bandwidth");
-    printf(
-        "-----------------------------------------------------------------------------------"
-        "--------------------"
-        "--------\n");
+void RepStats::Add(const RepBlock &rep)
+{
+    if (count == 0)
+        first = rep;
 
-    for (u64 i = 1; i < blocks.cap; i++)
-    {
-        auto next = blocks[i];
-        if (next.iterations == 0)
-            continue;
+    if (rep.time < min.time || count == 0)
+        min = rep;
 
-        f64 nextTimeEx = (f64(next.timeEx) / f64(perfFreq.QuadPart));
-        f64 nextTimeInc = (f64(next.timeInc) / f64(perfFreq.QuadPart));
-        if (next.bytesProcessed == 0)
+    if (rep.time >= max.time)
+        max = rep;
+
+    total.bytes += rep.bytes;
+    total.time += rep.time;
+    total.pageFaults += rep.pageFaults;
+    total.cycles += rep.cycles;
+    total.instructions += rep.instructions;
+    count++;
+}
+
+void RepProfiler::AddWorkingSet(void *data, u64 size)
+{
+    for (RepBuffer &buffer : workingSet)
+    {
+        if (buffer.data == data)
         {
-            printf(" %-20s [%llu] \t| %.5f secs\t(%.2f%%) \t| %.5f secs\t(%.2f%%) \t|\n",
-                   next.label,
-                   next.iterations,
-                   nextTimeEx,
-                   (nextTimeEx / totalTime) * 100,
-                   nextTimeInc,
-                   (nextTimeInc / totalTime) * 100);
+            buffer.size = size;
+            return;
         }
-        else
+    }
+
+    RepBuffer buffer = {.data = data, .size = size};
+    workingSet.Push(buffer);
+}
+
+// Reads a buffer twice the size of the last level cache, so whatever the kernel left behind is
+// evicted. Only reads: dirty lines would cost the next rep their write back.
+internal void EvictCaches()
+{
+    persist u8 *buffer = nullptr;
+    persist u64 size = 0;
+    if (!buffer)
+    {
+        u64 cacheSize = GetLastLevelCacheSize();
+        size = 2 * (cacheSize ? cacheSize : 32ull << 20);
+
+        bool largePages;
+        buffer = (u8 *)ReserveMemory(size, PROFILER_LARGE_PAGES, &largePages);
+        if (!buffer)
         {
-            printf(
-                " %-20s [%llu] \t| %.5f secs\t(%.2f%%) \t| %.5f secs\t(%.2f%%) \t| %.3f GB/s\n",
-                next.label,
-                next.iterations,
-                nextTimeEx,
-                (nextTimeEx / totalTime) * 100,
-                nextTimeInc,
-                (nextTimeInc / totalTime) * 100,
-                f64(next.bytesProcessed) / nextTimeEx / 1024.0 / 1024.0 / 1024.0);
+            ERR("Couldn't reserve %llu bytes to evict caches", size);
+            return;
         }
     }
+
+    u64 sum = 0;
+    for (u64 at = 0; at < size; at += 64)
+        sum += buffer[at];
+
+    persist volatile u64 sink;
+    sink = sum;
 }
 
-Profiler::~Profiler()
+internal void PrepareColdRep(RepProfiler &profiler)
 {
-    if (!Initialized)
+    // The body registers its buffers during the first rep at the latest, so the second cold rep
+    // is where a missing working set shows, once per profile.
+    if (profiler.repeats == 2 && profiler.workingSet.len == 0)
     {
-        Initialized = true;
-        return;
+        if (profiler.cacheMode == RepCacheFlush)
+            WARN("%s: RepCacheFlush without REPETITION_WORKING_SET evicts the whole cache instead",
+                 profiler.name);
+        else if (profiler.cacheMode == RepCacheRefault)
+            WARN("%s: RepCacheRefault without REPETITION_WORKING_SET, cold reps are the same as warm ones",
+                 profiler.name);
+    }
+
+    switch (profiler.cacheMode)
+    {
+    case RepCacheFlush:
+    {
+        bool flushed = profiler.workingSet.len > 0;
+        for (RepBuffer &buffer : profiler.workingSet)
+            flushed = FlushCacheLines(buffer.data, buffer.size) && flushed;
+        if (!flushed)
+            EvictCaches();
+    }
+    break;
+
+    case RepCacheEvict:
+        EvictCaches();
+        break;
+
+    case RepCacheRefault:
+        for (RepBuffer &buffer : profiler.workingSet)
+            DiscardMemory(buffer.data, buffer.size);
+        break;
+
+    case RepCacheWarm:
+        break;
     }
-    if (start != 0)
-        End();
 }
 
-Profiler Profiler::_Profiler = {};
-bool Profiler::Initialized = false;
+void RepProfiler::BeginRep()
+{
+    // Cold reps are the even ones, so every warm rep directly follows a cold one.
+    if (cacheMode != RepCacheWarm && repeats % 2 == 0)
+        PrepareColdRep(*this);
 
-extern "C"
+    // Slowest reads first and the timer last, so they stay outside the timed region.
+    current = RepBlock{};
+    current.pageFaults = Metrics::Get().ReadPageFaultCount();
+
+    u64 values[PerfCounters::Count];
+    counters.Read(values);
+    current.cycles = values[PerfCounters::Cycles];
+    current.instructions = values[PerfCounters::Instructions];
+
+    Profiler::Get().activeRep = this;
+    current.time = ReadTimer();
+}
+
+void RepProfiler::AddBytes(u64 bytes) { current.bytes += bytes; }
+
+void RepProfiler::EndRep()
 {
-    i32 ByTime(const void *from, const void *to)
+    current.time = ReadTimer() - current.time;
+    Profiler::Get().activeRep = nullptr;
+
+    u64 values[PerfCounters::Count];
+    counters.Read(values);
+    current.cycles = values[PerfCounters::Cycles] - current.cycles;
+    current.instructions = values[PerfCounters::Instructions] - current.instructions;
+
+    current.pageFaults = Metrics::Get().ReadPageFaultCount() - current.pageFaults;
+
+    inner.Commit(repeats, current.time, maxRepeats);
+
+    bool isCold = cacheMode != RepCacheWarm && repeats % 2 == 0;
+    (isCold ? cold : warm).Add(current);
+
+    repeats++;
+}
+
+// `rep` holds the sum of `count` reps.
+internal void FormatRep(char *out, u64 len, const RepBlock &rep, u64 count, const PerfCounters &counters)
+{
+    if (count == 0)
     {
-        return ((RepBlock *)(from))->time - ((RepBlock *)(to))->time;
+        snprintf(out, len, "-");
+        return;
     }
 
-    i32 ByBytes(const void *from, const void *to)
+    f64 reps = f64(count);
+    f64 seconds = f64(rep.time) / reps / f64(Timebase::Get().freq);
+    i32 written = snprintf(out,
+                           len,
+                           "%.3f ms\t%.3f GB/s\t%.*f pf",
+                           seconds * 1000.0,
+                           ToGb(f64(rep.bytes) / reps / seconds),
+                           count > 1 ? 2 : 0,
+                           f64(rep.pageFaults) / reps);
+
+    if (counters.valid && written > 0 && u64(written) < len)
     {
-        return ((RepBlock *)(from))->bytes - ((RepBlock *)(to))->bytes;
+        f64 cycles = f64(rep.cycles) / reps;
+        f64 instructions = f64(rep.instructions) / reps;
+        snprintf(out + written,
+                 len - u64(written),
+                 "\t%.0f cyc\t%.0f ins\t%.2f IPC",
+                 cycles,
+                 instructions,
+                 cycles ? instructions / cycles : 0.0);
     }
+}
 
-    i32 ByPageFaults(const void *from, const void *to)
+// Per inner block statistics over the recorded reps of one kind. Variance is the block's
+// covariance with the rep time over the rep time's variance: the part of the rep to rep
+// variation the block accounts for. Over all blocks plus untimed code it sums to 100%.
+internal void PrintInnerBlocks(RepProfiler &profiler, cstr kind, bool cold)
+{
+    RepMatrix &inner = profiler.inner;
+    u64 recorded = inner.Recorded(profiler.repeats);
+    bool alternating = profiler.cacheMode != RepCacheWarm;
+
+    f64 toMs = 1000.0 / f64(Timebase::Get().freq);
+    f64 n = 0, totalSum = 0, totalSq = 0;
+    for (u64 rep = inner.first; rep < inner.first + recorded; rep++)
     {
-        return ((RepBlock *)(from))->pageFaults - ((RepBlock *)(to))->pageFaults;
+        if (alternating && (rep % 2 == 0) != cold)
+            continue;
+        f64 total = f64(inner.Row(rep)[0]) * toMs;
+        n++;
+        totalSum += total;
+        totalSq += total * total;
+    }
+    if (n < 2)
+        return;
+
+    f64 totalMean = totalSum / n;
+    f64 totalVar = totalSq / n - totalMean * totalMean;
+
+    printf("\t> Inner blocks, %s reps (%.0f):\n", kind, n);
+    printf(" %-24s \t| %-10s \t| %-10s \t| %-10s \t| %-8s \t| %-6s \t| %-8s\n",
+           "Name",
+           "Min",
+           "Avg",
+           "Max",
+           "Share",
+           "Corr",
+           "Variance");
+    printf("-----------------------------------------------------------------------------------"
+           "----------------------------------------\n");
+
+    for (u64 column = 0; column < inner.ids.len; column++)
+    {
+        f64 min = 0, max = 0, sum = 0, sq = 0, cross = 0;
+        bool first = true;
+        for (u64 rep = inner.first; rep < inner.first + recorded; rep++)
+        {
+            if (alternating && (rep % 2 == 0) != cold)
+                continue;
+
+            u64 *row = inner.Row(rep);
+            f64 time = f64(row[column + 1]) * toMs;
+            min = first || time < min ? time : min;
+            max = first || time > max ? time : max;
+            first = false;
+            sum += time;
+            sq += time * time;
+            cross += time * f64(row[0]) * toMs;
+        }
+
+        f64 mean = sum / n;
+        f64 var = sq / n - mean * mean;
+        f64 cov = cross / n - mean * totalMean;
+        f64 corr = var > 0 && totalVar > 0 ? cov / sqrt(var * totalVar) : 0.0;
+        printf(" %-24s \t| %7.3f ms \t| %7.3f ms \t| %7.3f ms \t| %6.2f%% \t| %+.2f \t| %6.2f%%\n",
+               Profiler::Get().blocks[inner.ids[column]].label,
+               min,
+               mean,
+               max,
+               totalMean > 0 ? 100.0 * mean / totalMean : 0.0,
+               corr,
+               totalVar > 0 ? 100.0 * cov / totalVar : 0.0);
     }
 }
 
-static f64 ToGb(f64 bytes)
+internal void PrintBenchmarkEnvironment()
 {
-    return bytes / 1024.0 / 1024.0 / 1024.0;
+    if (!benchmarkInfo.benchmark)
+        return;
+
+    SystemInfo &info = benchmarkInfo;
+    printf("\t> Environment: \tCPU %d, %s governor, turbo %s, %u SMT siblings, %.3f%% noise\n",
+           info.pinnedCPU,
+           info.governor[0] ? info.governor : "unknown",
+           info.turbo < 0 ? "unknown" : info.turbo ? "on" : "off",
+           info.smtSiblings,
+           info.lostPercent);
 }
 
-RepProfiler RepProfiler::New(cstr name, u64 maxRepeats)
+RepProfiler::~RepProfiler()
 {
-    return RepProfiler{
-        .name = name,
-        .first = {},
-        .min = {},
-        .max = {},
-        .avg = {},
-        .current = {},
-        .repeats = 0,
-        .maxRepeats = maxRepeats,
-    };
+    INFO("Finished %s after %llu repeats.", name, repeats);
+
+    PrintBenchmarkEnvironment();
+
+    cstr modes[] = {"warm", "clflush", "LLC eviction", "refault"};
+    bool sideBySide = cacheMode != RepCacheWarm;
+    if (sideBySide)
+        printf("\t\t\tCold (%s)\t\t\t\t| Warm\n", modes[cacheMode]);
+
+    cstr labels[] = {"Initial", "Fastest", "Slowest", "Average"};
+    RepStats *stats[] = {&cold, &warm};
+    for (u32 row = 0; row < 4; row++)
+    {
+        char cells[2][128];
+        for (u32 column = 0; column < 2; column++)
+        {
+            RepStats &from = *stats[column];
+            const RepBlock *rows[] = {&from.first, &from.min, &from.max, &from.total};
+            u64 count = row == 3 ? from.count : (from.count ? 1 : 0);
+            FormatRep(cells[column], sizeof(cells[column]), *rows[row], count, counters);
+        }
+
+        if (sideBySide)
+            printf("\t> %s: \t%s\t| %s\n", labels[row], cells[0], cells[1]);
+        else
+            printf("\t> %s: \t%s\n", labels[row], cells[1]);
+    }
+
+    if (inner.ids.len > 0)
+    {
+        if (sideBySide)
+            PrintInnerBlocks(*this, "cold", true);
+        PrintInnerBlocks(*this, "warm", false);
+    }
+    if (inner.cells)
+        ReleaseMemory(inner.cells, inner.rows * inner.columns * sizeof(u64), false);
+    if (Profiler::Get().activeRep == this)
+        Profiler::Get().activeRep = nullptr;
+
+    counters.Close();
 }
 
-void RepProfiler::BeginRep()
+// Spins briefly, then yields, so oversubscribed sweeps still make progress.
+internal void SpinBarrier(std::atomic<u32> &arrived, std::atomic<u32> &generation, u32 threads)
 {
-    LARGE_INTEGER perfCounter;
-    QueryPerformanceCounter(&perfCounter);
-    current = RepBlock{
-        .time = u64(perfCounter.QuadPart),
-        .bytes = 0,
-        .pageFaults = Metrics::Get().ReadPageFaultCount(),
-    };
+    u32 current = generation.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == threads)
+    {
+        arrived.store(0, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        return;
+    }
+
+    for (u32 spins = 0; generation.load(std::memory_order_acquire) == current; spins++)
+    {
+        if (spins < 1024)
+            CPUPause();
+        else
+            std::this_thread::yield();
+    }
 }
 
-void RepProfiler::AddBytes(u64 bytes) { current.bytes += bytes; }
+struct ParallelReps
+{
+    RepKernel kernel;
+    void *context;
+    u64 repeats;
+    u32 threads;
+    std::atomic<u32> arrived, generation;
+    u64 starts[MAX_REP_THREADS], ends[MAX_REP_THREADS], bytes[MAX_REP_THREADS];
+    RepStats stats;
+};
 
-void RepProfiler::EndRep()
+// Thread 0 combines each rep between the end barrier and the next start barrier, so no thread
+// writes its slot while it's being read.
+internal void RunParallelReps(ParallelReps &reps, u32 thread, i32 cpu)
 {
-    LARGE_INTEGER perfCounter;
-    QueryPerformanceCounter(&perfCounter);
-    current.time = perfCounter.QuadPart - current.time;
-    current.pageFaults = Metrics::Get().ReadPageFaultCount() - current.pageFaults;
+    if (cpu >= 0)
+        PinThreadToCPU(u32(cpu));
+
+    for (u64 rep = 0; rep < reps.repeats; rep++)
+    {
+        SpinBarrier(reps.arrived, reps.generation, reps.threads);
+        reps.starts[thread] = ReadTimer();
+        reps.bytes[thread] = reps.kernel(reps.context, thread, reps.threads);
+        reps.ends[thread] = ReadTimer();
+        SpinBarrier(reps.arrived, reps.generation, reps.threads);
+
+        if (thread != 0)
+            continue;
+
+        u64 first = reps.starts[0], last = reps.ends[0];
+        RepBlock result = {};
+        for (u32 i = 0; i < reps.threads; i++)
+        {
+            first = reps.starts[i] < first ? reps.starts[i] : first;
+            last = reps.ends[i] > last ? reps.ends[i] : last;
+            result.bytes += reps.bytes[i];
+        }
+        result.time = last - first;
+        reps.stats.Add(result);
+    }
+}
 
-    if (current.time < min.time || min.time == 0)
+void RepProfiler::RunParallel(cstr name, u64 repeats, u32 maxThreads, RepKernel kernel, void *context)
+{
+    Timebase::Calibrate();
+    u32 processors = std::thread::hardware_concurrency();
+    maxThreads = maxThreads ? maxThreads : 1;
+    if (maxThreads > MAX_REP_THREADS)
     {
-        min = current;
+        WARN("Clamping %u threads to MAX_REP_THREADS (%d)", maxThreads, MAX_REP_THREADS);
+        maxThreads = MAX_REP_THREADS;
     }
+    if (processors && maxThreads > processors)
+        WARN("Sweeping up to %u threads on %u logical CPUs, the last points are oversubscribed",
+             maxThreads,
+             processors);
+
+    StackArray<RepScaling, MAX_REP_THREADS> points = {};
+    i32 pinned = benchmarkInfo.benchmark ? benchmarkInfo.pinnedCPU : -1;
 
-    if (current.time >= max.time)
+    // The sweep runs at normal priority: threads inherit it, and realtime threads spinning on the
+    // barrier would starve the ones sharing their CPU.
+    bool raised = benchmarkInfo.benchmark && benchmarkInfo.raisedPriority;
+    if (raised)
+        ResetThreadPriority();
+    // Powers of two, then maxThreads itself.
+    for (u32 threads = 1;; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads)
     {
-        max = current;
+        ParallelReps reps = {};
+        reps.kernel = kernel;
+        reps.context = context;
+        reps.repeats = repeats;
+        reps.threads = threads;
+
+        std::thread workers[MAX_REP_THREADS];
+        for (u32 i = 1; i < threads; i++)
+        {
+            i32 cpu = pinned >= 0 ? i32((u32(pinned) + i) % (processors ? processors : 1)) : -1;
+            workers[i] = std::thread(RunParallelReps, std::ref(reps), i, cpu);
+        }
+        RunParallelReps(reps, 0, -1);
+        for (u32 i = 1; i < threads; i++)
+            workers[i].join();
+
+        RepScaling point = {.threads = threads, .stats = reps.stats};
+        points.Push(point);
+        if (threads >= maxThreads)
+            break;
     }
+    if (raised)
+        RaiseThreadPriority();
 
-    avg.bytes += current.bytes;
-    avg.time += current.time;
-    avg.pageFaults += current.pageFaults;
+    INFO("Finished %s scaling sweep, %llu repeats per thread count", name, repeats);
+    printf(" %-8s \t| %-12s \t| %-12s \t| %-14s \t| %-14s \t| %-10s\n",
+           "Threads",
+           "Fastest",
+           "Average",
+           "Aggregate",
+           "Per thread",
+           "Efficiency");
+    printf(
+        "-----------------------------------------------------------------------------------"
+        "--------------------"
+        "--------\n");
 
-    if (repeats == 0)
-        first = current;
+    // Efficiency compares throughput against `threads` copies of the single thread run. Kernels
+    // that report no bytes are assumed to do the same work on every thread.
+    Timebase &timebase = Timebase::Get();
+    f64 baseline = 0, previous = 0;
+    u32 saturation = 0;
+    f64 saturationGb = 0;
+    for (RepScaling &point : points)
+    {
+        RepStats &stats = point.stats;
+        f64 fastest = timebase.ToSeconds(stats.min.time);
+        f64 average = timebase.ToSeconds(stats.total.time) / f64(stats.count ? stats.count : 1);
+        f64 work = stats.min.bytes ? f64(stats.min.bytes) : f64(point.threads);
+        f64 throughput = fastest > 0 ? work / fastest : 0;
+        if (point.threads == 1)
+            baseline = throughput;
 
-    repeats++;
+        f64 aggregate = stats.min.bytes ? ToGb(throughput) : 0;
+        printf(" %-8u \t| %.3f ms \t| %.3f ms \t| %.3f GB/s \t| %.3f GB/s \t| %.1f%%\n",
+               point.threads,
+               fastest * 1000.0,
+               average * 1000.0,
+               aggregate,
+               aggregate / f64(point.threads),
+               baseline > 0 ? throughput / (baseline * f64(point.threads)) * 100.0 : 0.0);
+
+        // First point that adds less than 5% over the previous one.
+        if (!saturation && previous > 0 && throughput < previous * 1.05)
+        {
+            saturation = point.threads;
+            saturationGb = aggregate;
+        }
+        previous = throughput;
+    }
+
+    if (saturation && saturationGb > 0)
+        INFO("Throughput stops scaling at %u threads (%.3f GB/s)", saturation, saturationGb);
+    else if (saturation)
+        INFO("Throughput stops scaling at %u threads", saturation);
 }
 
-RepProfiler::~RepProfiler()
+internal i32 ByTicks(const void *from, const void *to)
 {
-    INFO("Finished %s after %llu repeats.", name, repeats);
+    u64 a = *(const u64 *)from, b = *(const u64 *)to;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Two-sided 95% quantile of Student's t, by the Cornish-Fisher expansion around the normal one.
+// Within 0.5% of the exact value from 3 degrees of freedom on.
+internal f64 StudentT95(u64 df)
+{
+    f64 z = 1.959964, n = f64(df ? df : 1);
+    f64 z3 = z * z * z, z5 = z3 * z * z;
+    return z + (z3 + z) / (4.0 * n) + (5.0 * z5 + 16.0 * z3 + 3.0 * z) / (96.0 * n * n);
+}
+
+void RepProfiler::Compare(cstr name, u64 rounds, RepVariant *variants, u32 count)
+{
+    Timebase::Calibrate();
+    if (count == 0 || rounds < 2)
+    {
+        ERR("Comparing %s needs a variant and at least two rounds", name);
+        return;
+    }
+    if (count > MAX_REP_VARIANTS)
+    {
+        WARN("Only the first MAX_REP_VARIANTS (%d) variants are compared", MAX_REP_VARIANTS);
+        count = MAX_REP_VARIANTS;
+    }
 
-    // FIRST
-    LARGE_INTEGER perfFreq;
-    QueryPerformanceFrequency(&perfFreq);
-
-    f64 firstTime = f64(first.time) / f64(perfFreq.QuadPart);
-    printf("\t> Initial: \t%.3f ms\t%.3f GB/s\t%llu pf\n",
-           firstTime * 1000.0,
-           ToGb(f64(first.bytes) / firstTime),
-           first.pageFaults);
-
-    // MIN
-    f64 minTime = f64(min.time) / f64(perfFreq.QuadPart);
-    printf("\t> Fastest: \t%.3f ms\t%.3f GB/s\t%llu pf\n",
-           minTime * 1000.0,
-           ToGb(f64(min.bytes) / minTime),
-           min.pageFaults);
-
-    // MAX
-    f64 maxTime = f64(max.time) / f64(perfFreq.QuadPart);
-    printf("\t> Slowest: \t%.3f ms\t%.3f GB/s\t%llu pf\n",
-           maxTime * 1000.0,
-           ToGb(f64(max.bytes) / maxTime),
-           max.pageFaults);
-
-    // AVERAGE
-    f64 avgBytes = f64(avg.bytes) / f64(repeats);
-    f64 avgFaults = f64(avg.pageFaults) / f64(repeats);
-    f64 avgTime = f64(avg.time) / f64(repeats);
-    avgTime /= f64(perfFreq.QuadPart);
-
-    printf("\t> Average: \t%.3f ms\t%.3f GB/s\t%.2f pf\n",
-           avgTime * 1000.0,
-           ToGb(f64(avgBytes) / avgTime),
-           avgFaults);
+    // Round r's time of variant v is times[r * count + v].
+    bool largePages;
+    u64 timesBytes = (rounds * count + rounds) * sizeof(u64);
+    u64 *times = (u64 *)ReserveMemory(timesBytes, false, &largePages);
+    if (!times)
+    {
+        ERR("Couldn't reserve %llu bytes for %llu rounds", timesBytes, rounds);
+        return;
+    }
+    u64 *sorted = times + rounds * count;
+
+    // Warms up caches, branch predictors and lazy initialization without being recorded.
+    for (u32 v = 0; v < count; v++)
+        variants[v].body(variants[v].context);
+
+    RepStats stats[MAX_REP_VARIANTS] = {};
+    u32 order[MAX_REP_VARIANTS];
+    for (u32 v = 0; v < count; v++)
+        order[v] = v;
+
+    u32 state = 2463534242u ^ u32(ReadTimer());
+    for (u64 round = 0; round < rounds; round++)
+    {
+        // Fisher-Yates with xorshift32.
+        for (u32 i = count - 1; i > 0; i--)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            u32 j = state % (i + 1);
+            u32 swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+
+        for (u32 i = 0; i < count; i++)
+        {
+            RepVariant &variant = variants[order[i]];
+
+            RepBlock rep = {};
+            rep.pageFaults = Metrics::Get().ReadPageFaultCount();
+            rep.time = ReadTimer();
+            rep.bytes = variant.body(variant.context);
+            rep.time = ReadTimer() - rep.time;
+            rep.pageFaults = Metrics::Get().ReadPageFaultCount() - rep.pageFaults;
+
+            stats[order[i]].Add(rep);
+            times[round * count + order[i]] = rep.time;
+        }
+    }
+
+    INFO("Compared %u variants of %s over %llu rounds in random order", count, name, rounds);
+    PrintBenchmarkEnvironment();
+
+    f64 toMs = 1000.0 / f64(Timebase::Get().freq);
+    printf(" %-20s \t| %-10s \t| %-10s \t| %-10s \t| %-10s \t| Speedup over %s (95%% CI)\n",
+           "Variant",
+           "Min",
+           "Median",
+           "Mean",
+           "Bandwidth",
+           variants[0].label);
+    printf("-----------------------------------------------------------------------------------"
+           "----------------------------------------\n");
+
+    for (u32 v = 0; v < count; v++)
+    {
+        for (u64 round = 0; round < rounds; round++)
+            sorted[round] = times[round * count + v];
+        qsort(sorted, rounds, sizeof(u64), ByTicks);
+        f64 median = rounds % 2 ? f64(sorted[rounds / 2])
+                                : 0.5 * (f64(sorted[rounds / 2 - 1]) + f64(sorted[rounds / 2]));
+
+        RepStats &stat = stats[v];
+        f64 meanSeconds = f64(stat.total.time) / f64(stat.count) / f64(Timebase::Get().freq);
+        printf(" %-20s \t| %7.3f ms \t| %7.3f ms \t| %7.3f ms \t| ",
+               variants[v].label,
+               f64(stat.min.time) * toMs,
+               median * toMs,
+               f64(stat.total.time) / f64(stat.count) * toMs);
+        if (stat.total.bytes)
+            printf("%6.3f GB/s \t| ", ToGb(f64(stat.total.bytes) / f64(stat.count) / meanSeconds));
+        else
+            printf("%-10s \t| ", "-");
+
+        if (v == 0)
+        {
+            printf("baseline\n");
+            continue;
+        }
+
+        // Rounds pair the variants up under the same conditions, so the interval is on the mean
+        // per-round log ratio, which makes the speedup a geometric mean.
+        f64 sum = 0, sq = 0, n = 0;
+        for (u64 round = 0; round < rounds; round++)
+        {
+            u64 base = times[round * count], time = times[round * count + v];
+            if (!base || !time)
+                continue;
+            f64 ratio = log(f64(base) / f64(time));
+            sum += ratio;
+            sq += ratio * ratio;
+            n++;
+        }
+
+        f64 mean = n ? sum / n : 0.0;
+        f64 variance = n > 1 ? (sq - n * mean * mean) / (n - 1) : 0.0;
+        f64 half = n > 1 ? StudentT95(u64(n) - 1) * sqrt(variance > 0 ? variance / n : 0.0) : 0.0;
+        f64 low = exp(mean - half), high = exp(mean + half);
+        printf("%.3fx [%.3fx, %.3fx] %s\n",
+               exp(mean),
+               low,
+               high,
+               low > 1.0    ? "faster"
+               : high < 1.0 ? "slower"
+                            : "no significant difference");
+    }
+
+    ReleaseMemory(times, timesBytes, false);
 }
 
 #ifndef DISABLE_PROFILER
 
 #define PROFILER_NEW(name) Profiler::New(name)
+#define PROFILER_START() Profiler::Get().Start()
 #define PROFILER_END() Profiler::Get().End()
-#define PROFILE_BLOCK_BEGIN(name) \
-    Profiler::Get().BeginBlock(__COUNTER__ + 1, name, __FILE__, __LINE__)
+#define PROFILE_BLOCK_BEGIN(name) PROFILER_ENTER_BLOCK(__COUNTER__ + 1, name, __FILE__, __LINE__)
 #define PROFILE_ADD_BANDWIDTH(bytes) Profiler::Get().AddBytes(bytes)
-#define PROFILE_BLOCK_END() Profiler::Get().EndBlock()
+#define PROFILE_BLOCK_END() PROFILER_EXIT_BLOCK()
 #define PROFILE_SCOPE(name) \
-    auto _profilerFlag = Profiler::Get().BeginScopeBlock(__COUNTER__ + 1, name, __FILE__, __LINE__)
+    auto _profilerFlag = PROFILER_SCOPE_BLOCK(__COUNTER__ + 1, name, __FILE__, __LINE__)
 #define PROFILE_FUNCTION() \
-    auto _profilerFlag =   \
-        Profiler::Get().BeginScopeBlock(__COUNTER__ + 1, __func__, __FILE__, __LINE__)
-#define PROFILE(name, code)                                                \
-    Profiler::Get().BeginBlock(__COUNTER__ + 1, name, __FILE__, __LINE__); \
-    code;                                                                  \
-    Profiler::Get().EndBlock();
-
-#define REPETITION_PROFILE(name, count)                  \
-    do                                                   \
-    {                                                    \
-        auto _profiler = RepProfiler::New(name, count);  \
-        while (_profiler.repeats < _profiler.maxRepeats) \
-        {                                                \
+    auto _profilerFlag = PROFILER_SCOPE_BLOCK(__COUNTER__ + 1, __func__, __FILE__, __LINE__)
+#define PROFILE(name, code)                                          \
+    PROFILER_ENTER_BLOCK(__COUNTER__ + 1, name, __FILE__, __LINE__); \
+    code;                                                            \
+    PROFILER_EXIT_BLOCK();
+
+#define REPETITION_PROFILE(name, count, ...)                           \
+    do                                                                 \
+    {                                                                  \
+        auto _profiler = RepProfiler::New(name, count, ##__VA_ARGS__); \
+        while (_profiler.repeats < _profiler.maxRepeats)               \
+        {                                                              \
             _profiler.BeginRep();
 
 #define REPETITION_BANDWIDTH(bytes) _profiler.AddBytes(bytes)
@@ -298,6 +2774,7 @@ RepProfiler::~RepProfiler()
 #else
 
 #define PROFILER_NEW(...)
+#define PROFILER_START(...)
 #define PROFILER_END(...)
 #define PROFILE_BLOCK_BEGIN(...)
 #define PROFILE_ADD_BANDWIDTH(...)
@@ -0,0 +1,807 @@
+// Standard headers go first: types.hpp defines `global`, which collides with libstdc++ internals.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "symbolizer.hpp"
+
+Symbolizer &Symbolizer::Get()
+{
+    persist Symbolizer symbolizer;
+    return symbolizer;
+}
+
+#if defined(__linux__)
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SYMBOL_CACHE_MAGIC "PRFSYMS2"
+
+struct SymbolCacheHeader
+{
+    char magic[8];
+    u64 fileSize, fileInode, fileTime; // fileTime in ns
+    u64 symbolCount, lineCount, stringBytes;
+};
+
+// Collects one module's index before it's written out.
+struct IndexBuilder
+{
+    std::vector<SymbolModule::Symbol> symbols;
+    std::vector<SymbolModule::Line> lines;
+    std::string strings;
+    std::unordered_map<std::string, u32> interned;
+
+    u32 Intern(const std::string &value)
+    {
+        auto found = interned.find(value);
+        if (found != interned.end())
+            return found->second;
+
+        u32 offset = u32(strings.size());
+        strings.append(value);
+        strings.push_back(0);
+        interned[value] = offset;
+        return offset;
+    }
+};
+
+struct ElfFile
+{
+    const u8 *data;
+    u64 size;
+    const Elf64_Ehdr *header;
+    const Elf64_Shdr *sections;
+
+    const Elf64_Shdr *Section(u32 index) const
+    {
+        return index < header->e_shnum ? &sections[index] : nullptr;
+    }
+
+    bool Contains(const Elf64_Shdr *section) const
+    {
+        return section && section->sh_type != SHT_NOBITS && section->sh_offset + section->sh_size <= size;
+    }
+
+    const Elf64_Shdr *FindSection(cstr name) const
+    {
+        const Elf64_Shdr *names = Section(header->e_shstrndx);
+        if (!Contains(names))
+            return nullptr;
+
+        for (u32 i = 0; i < header->e_shnum; i++)
+        {
+            if (sections[i].sh_name < names->sh_size &&
+                strcmp((cstr)data + names->sh_offset + sections[i].sh_name, name) == 0)
+                return Contains(&sections[i]) ? &sections[i] : nullptr;
+        }
+        return nullptr;
+    }
+};
+
+internal void ReadSymbols(const ElfFile &elf, u32 type, IndexBuilder &builder)
+{
+    for (u32 i = 0; i < elf.header->e_shnum; i++)
+    {
+        const Elf64_Shdr &table = elf.sections[i];
+        const Elf64_Shdr *names = elf.Section(table.sh_link);
+        if (table.sh_type != type || !elf.Contains(&table) || !elf.Contains(names))
+            continue;
+
+        const Elf64_Sym *symbols = (const Elf64_Sym *)(elf.data + table.sh_offset);
+        u64 count = table.sh_size / sizeof(Elf64_Sym);
+        for (u64 j = 0; j < count; j++)
+        {
+            const Elf64_Sym &symbol = symbols[j];
+            if (ELF64_ST_TYPE(symbol.st_info) != STT_FUNC || symbol.st_shndx == SHN_UNDEF ||
+                symbol.st_value == 0 || symbol.st_name >= names->sh_size)
+                continue;
+
+            cstr name = (cstr)elf.data + names->sh_offset + symbol.st_name;
+            i32 status = 0;
+            char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+            u32 offset = builder.Intern(status == 0 && demangled ? demangled : name);
+            free(demangled);
+
+            builder.symbols.push_back(SymbolModule::Symbol{
+                .address = symbol.st_value,
+                .size = symbol.st_size,
+                .name = offset,
+                .pad = 0,
+            });
+        }
+    }
+}
+
+struct DwarfReader
+{
+    const u8 *at, *end;
+
+    bool Has(u64 bytes) const { return u64(end - at) >= bytes; }
+
+    template <typename T>
+    T Read()
+    {
+        T result = {};
+        if (Has(sizeof(T)))
+            memcpy(&result, at, sizeof(T));
+        at = Has(sizeof(T)) ? at + sizeof(T) : end;
+        return result;
+    }
+
+    u64 ULEB()
+    {
+        u64 result = 0;
+        for (u32 shift = 0; at < end; shift += 7)
+        {
+            u8 byte = *at++;
+            if (shift < 64)
+                result |= u64(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return result;
+    }
+
+    i64 SLEB()
+    {
+        i64 result = 0;
+        u32 shift = 0;
+        u8 byte = 0;
+        while (at < end)
+        {
+            byte = *at++;
+            if (shift < 64)
+                result |= i64(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80))
+                break;
+        }
+        if (shift < 64 && (byte & 0x40))
+            result |= -(i64(1) << shift);
+        return result;
+    }
+
+    cstr String()
+    {
+        cstr result = (cstr)at;
+        while (at < end && *at)
+            at++;
+        if (at < end)
+            at++;
+        return result;
+    }
+
+    u64 Offset(bool is64) { return is64 ? Read<u64>() : Read<u32>(); }
+};
+
+enum
+{
+    DW_FORM_block = 0x09,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_string = 0x08,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_line_strp = 0x1f,
+
+    DW_LNCT_path = 1,
+    DW_LNCT_directory_index = 2,
+};
+
+struct DwarfStrings
+{
+    const Elf64_Shdr *str, *lineStr;
+    const ElfFile *elf;
+
+    cstr At(const Elf64_Shdr *section, u64 offset) const
+    {
+        if (!section || offset >= section->sh_size)
+            return "";
+        return (cstr)elf->data + section->sh_offset + offset;
+    }
+};
+
+// Reads one DWARF 5 directory or file entry attribute. Strings come back in `text`, numbers in
+// `number`; anything else is skipped.
+internal bool ReadEntryForm(DwarfReader &reader, u64 form, bool is64, const DwarfStrings &strings,
+                            cstr *text, u64 *number)
+{
+    switch (form)
+    {
+    case DW_FORM_string:
+        *text = reader.String();
+        return true;
+    case DW_FORM_strp:
+        *text = strings.At(strings.str, reader.Offset(is64));
+        return true;
+    case DW_FORM_line_strp:
+        *text = strings.At(strings.lineStr, reader.Offset(is64));
+        return true;
+    case DW_FORM_udata:
+        *number = reader.ULEB();
+        return true;
+    case DW_FORM_data1:
+        *number = reader.Read<u8>();
+        return true;
+    case DW_FORM_data2:
+        *number = reader.Read<u16>();
+        return true;
+    case DW_FORM_data4:
+        *number = reader.Read<u32>();
+        return true;
+    case DW_FORM_data8:
+        *number = reader.Read<u64>();
+        return true;
+    case DW_FORM_data16:
+        reader.at = reader.Has(16) ? reader.at + 16 : reader.end;
+        return true;
+    case DW_FORM_block:
+    {
+        u64 len = reader.ULEB();
+        reader.at = reader.Has(len) ? reader.at + len : reader.end;
+        return true;
+    }
+    }
+
+    return false;
+}
+
+internal std::string JoinPath(cstr directory, cstr name)
+{
+    if (name[0] == '/' || !directory || !directory[0])
+        return name;
+    return std::string(directory) + "/" + name;
+}
+
+// Runs the line number program of every unit in .debug_line (DWARF 2 to 5).
+internal void ReadLines(const ElfFile &elf, IndexBuilder &builder)
+{
+    const Elf64_Shdr *section = elf.FindSection(".debug_line");
+    if (!section || (section->sh_flags & SHF_COMPRESSED))
+        return;
+
+    DwarfStrings strings = {
+        .str = elf.FindSection(".debug_str"),
+        .lineStr = elf.FindSection(".debug_line_str"),
+        .elf = &elf,
+    };
+
+    DwarfReader reader = {elf.data + section->sh_offset, elf.data + section->sh_offset + section->sh_size};
+    while (reader.Has(4))
+    {
+        u64 length = reader.Read<u32>();
+        bool is64 = length == 0xffffffff;
+        if (is64)
+            length = reader.Read<u64>();
+        if (!reader.Has(length))
+            return;
+
+        const u8 *unitEnd = reader.at + length;
+        DwarfReader unit = {reader.at, unitEnd};
+        reader.at = unitEnd;
+
+        u16 version = unit.Read<u16>();
+        if (version < 2 || version > 5)
+            continue;
+        if (version >= 5)
+        {
+            u8 addressSize = unit.Read<u8>();
+            unit.Read<u8>(); // Segment selector size
+            if (addressSize != 8)
+                continue;
+        }
+
+        u64 headerLength = unit.Offset(is64);
+        const u8 *program = unit.Has(headerLength) ? unit.at + headerLength : unitEnd;
+        u8 minInstructionLength = unit.Read<u8>();
+        if (version >= 4)
+            unit.Read<u8>(); // Maximum operations per instruction, only for VLIW
+        bool defaultIsStmt = unit.Read<u8>() != 0;
+        i8 lineBase = unit.Read<i8>();
+        u8 lineRange = unit.Read<u8>();
+        u8 opcodeBase = unit.Read<u8>();
+        if (lineRange == 0 || opcodeBase == 0)
+            continue;
+
+        u8 opcodeLengths[256] = {};
+        for (u32 i = 1; i < opcodeBase; i++)
+            opcodeLengths[i] = unit.Read<u8>();
+
+        std::vector<cstr> directories;
+        std::vector<u32> files;
+        if (version >= 5)
+        {
+            for (u32 list = 0; list < 2; list++)
+            {
+                u8 formatCount = unit.Read<u8>();
+                u64 formats[32][2] = {};
+                for (u32 i = 0; i < formatCount && i < 32; i++)
+                {
+                    formats[i][0] = unit.ULEB();
+                    formats[i][1] = unit.ULEB();
+                }
+
+                u64 count = unit.ULEB();
+                for (u64 entry = 0; entry < count && unit.at < unitEnd; entry++)
+                {
+                    cstr path = "";
+                    u64 directory = 0;
+                    for (u32 i = 0; i < formatCount && i < 32; i++)
+                    {
+                        cstr text = nullptr;
+                        u64 number = 0;
+                        if (!ReadEntryForm(unit, formats[i][1], is64, strings, &text, &number))
+                        {
+                            unit.at = unitEnd;
+                            break;
+                        }
+                        if (formats[i][0] == DW_LNCT_path && text)
+                            path = text;
+                        else if (formats[i][0] == DW_LNCT_directory_index)
+                            directory = number;
+                    }
+
+                    if (list == 0)
+                        directories.push_back(path);
+                    else
+                        files.push_back(builder.Intern(
+                            JoinPath(directory < directories.size() ? directories[directory] : "", path)));
+                }
+            }
+        }
+        else
+        {
+            // Directory 0 and file 0 are implicit before DWARF 5.
+            directories.push_back("");
+            files.push_back(builder.Intern(""));
+            for (cstr directory = unit.String(); directory[0]; directory = unit.String())
+                directories.push_back(directory);
+            for (cstr name = unit.String(); name[0] && unit.at < unitEnd; name = unit.String())
+            {
+                u64 directory = unit.ULEB();
+                unit.ULEB(); // Modification time
+                unit.ULEB(); // Length
+                files.push_back(
+                    builder.Intern(JoinPath(directory < directories.size() ? directories[directory] : "", name)));
+            }
+        }
+
+        u64 address = 0, file = 1, line = 1;
+        bool isStmt = defaultIsStmt;
+        auto emit = [&](u32 atLine)
+        {
+            u32 name = file < files.size() ? files[file] : 0;
+            builder.lines.push_back(SymbolModule::Line{.address = address, .file = name, .line = atLine});
+        };
+
+        unit.at = program;
+        while (unit.at < unitEnd)
+        {
+            u8 opcode = unit.Read<u8>();
+            if (opcode >= opcodeBase)
+            {
+                u8 adjusted = opcode - opcodeBase;
+                address += u64(adjusted / lineRange) * minInstructionLength;
+                line += lineBase + adjusted % lineRange;
+                emit(u32(line));
+                continue;
+            }
+
+            switch (opcode)
+            {
+            case 0: // Extended
+            {
+                u64 len = unit.ULEB();
+                const u8 *next = unit.Has(len) ? unit.at + len : unitEnd;
+                u8 extended = len ? unit.Read<u8>() : 0;
+                if (extended == 1) // End sequence
+                {
+                    emit(0);
+                    address = 0;
+                    file = 1;
+                    line = 1;
+                    isStmt = defaultIsStmt;
+                }
+                else if (extended == 2 && len == 9) // Set address
+                {
+                    address = unit.Read<u64>();
+                }
+                unit.at = next;
+            }
+            break;
+            case 1: // Copy
+                emit(u32(line));
+                break;
+            case 2: // Advance pc
+                address += unit.ULEB() * minInstructionLength;
+                break;
+            case 3: // Advance line
+                line += unit.SLEB();
+                break;
+            case 4: // Set file
+                file = unit.ULEB();
+                break;
+            case 6: // Negate stmt
+                isStmt = !isStmt;
+                break;
+            case 8: // Const add pc
+                address += u64((255 - opcodeBase) / lineRange) * minInstructionLength;
+                break;
+            case 9: // Fixed advance pc
+                address += unit.Read<u16>();
+                break;
+            default: // Set column, basic block, prologue end, ... and unknown opcodes
+                for (u32 i = 0; i < opcodeLengths[opcode]; i++)
+                    unit.ULEB();
+                break;
+            }
+        }
+    }
+}
+
+internal bool BuildIndex(cstr path, IndexBuilder &builder)
+{
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || u64(info.st_size) < sizeof(Elf64_Ehdr))
+    {
+        close(fd);
+        return false;
+    }
+
+    u64 size = u64(info.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    ElfFile elf = {.data = (const u8 *)data, .size = size, .header = (const Elf64_Ehdr *)data, .sections = nullptr};
+    bool valid = memcmp(elf.header->e_ident, ELFMAG, SELFMAG) == 0 && elf.header->e_ident[EI_CLASS] == ELFCLASS64 &&
+                 elf.header->e_shoff + u64(elf.header->e_shnum) * sizeof(Elf64_Shdr) <= size;
+    if (valid)
+    {
+        elf.sections = (const Elf64_Shdr *)(elf.data + elf.header->e_shoff);
+
+        // Stripped binaries only have .dynsym. Where both exist, .symtab also has local symbols.
+        builder.Intern("");
+        ReadSymbols(elf, SHT_SYMTAB, builder);
+        if (builder.symbols.empty())
+            ReadSymbols(elf, SHT_DYNSYM, builder);
+        ReadLines(elf, builder);
+
+        std::stable_sort(builder.symbols.begin(),
+                         builder.symbols.end(),
+                         [](const SymbolModule::Symbol &a, const SymbolModule::Symbol &b)
+                         { return a.address < b.address; });
+        // Aliases share an address; keep the first.
+        builder.symbols.erase(std::unique(builder.symbols.begin(),
+                                          builder.symbols.end(),
+                                          [](const SymbolModule::Symbol &a, const SymbolModule::Symbol &b)
+                                          { return a.address == b.address; }),
+                              builder.symbols.end());
+
+        // Sequence ends sort before rows starting at the same address.
+        std::stable_sort(builder.lines.begin(),
+                         builder.lines.end(),
+                         [](const SymbolModule::Line &a, const SymbolModule::Line &b)
+                         { return a.address != b.address ? a.address < b.address : a.line < b.line; });
+    }
+
+    munmap(data, size);
+    return valid;
+}
+
+internal std::string CachePath(const std::string &cacheDir, const std::string &path)
+{
+    u64 hash = 14695981039346656037ull;
+    for (char c : path)
+        hash = (hash ^ u8(c)) * 1099511628211ull;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-", (unsigned long long)hash);
+    u64 slash = path.find_last_of('/');
+    return cacheDir + "/" + name + path.substr(slash == std::string::npos ? 0 : slash + 1) + ".syms";
+}
+
+// Points the module at a header and the three arrays that follow it.
+internal bool UseIndex(SymbolModule &module, const u8 *data, u64 size)
+{
+    const SymbolCacheHeader *header = (const SymbolCacheHeader *)data;
+    u64 symbolBytes = header->symbolCount * sizeof(SymbolModule::Symbol);
+    u64 lineBytes = header->lineCount * sizeof(SymbolModule::Line);
+    if (sizeof(SymbolCacheHeader) + symbolBytes + lineBytes + header->stringBytes > size)
+        return false;
+
+    module.symbols = (const SymbolModule::Symbol *)(data + sizeof(SymbolCacheHeader));
+    module.lines = (const SymbolModule::Line *)(data + sizeof(SymbolCacheHeader) + symbolBytes);
+    module.strings = (cstr)(data + sizeof(SymbolCacheHeader) + symbolBytes + lineBytes);
+    module.symbolCount = header->symbolCount;
+    module.lineCount = header->lineCount;
+    module.stringBytes = header->stringBytes;
+    return true;
+}
+
+// Whole seconds would miss a rebuild within the same second of the cached one.
+internal u64 FileTime(const struct stat &info)
+{
+    return u64(info.st_mtim.tv_sec) * 1000000000ull + u64(info.st_mtim.tv_nsec);
+}
+
+internal bool LoadCachedIndex(SymbolModule &module, const std::string &cachePath, const struct stat &info)
+{
+    i32 fd = open(cachePath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat cacheInfo;
+    bool result = false;
+    if (fstat(fd, &cacheInfo) == 0 && u64(cacheInfo.st_size) >= sizeof(SymbolCacheHeader))
+    {
+        u64 size = u64(cacheInfo.st_size);
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            const SymbolCacheHeader *header = (const SymbolCacheHeader *)data;
+            result = memcmp(header->magic, SYMBOL_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                     header->fileSize == u64(info.st_size) && header->fileInode == u64(info.st_ino) &&
+                     header->fileTime == FileTime(info) &&
+                     UseIndex(module, (const u8 *)data, size);
+            if (result)
+            {
+                module.mapping = data;
+                module.mappingSize = size;
+                module.cached = true;
+            }
+            else
+            {
+                munmap(data, size);
+            }
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+// Written to a temporary file and renamed, so concurrent runs never see a partial index.
+internal void WriteCachedIndex(const std::vector<u8> &index, const std::string &cachePath)
+{
+    std::string temporary = cachePath + "." + std::to_string(getpid());
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        return;
+
+    bool written = fwrite(index.data(), 1, index.size(), file) == index.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporary.c_str(), cachePath.c_str()) != 0)
+        unlink(temporary.c_str());
+}
+
+internal SymbolModule *IndexModule(const std::string &path, const std::string &cacheDir)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return nullptr;
+
+    SymbolModule *module = new SymbolModule();
+    module->path = path;
+
+    std::string cachePath = cacheDir.empty() ? "" : CachePath(cacheDir, path);
+    if (!cachePath.empty() && LoadCachedIndex(*module, cachePath, info))
+        return module;
+
+    IndexBuilder builder;
+    if (!BuildIndex(path.c_str(), builder))
+    {
+        delete module;
+        return nullptr;
+    }
+
+    SymbolCacheHeader header = {
+        .magic = {},
+        .fileSize = u64(info.st_size),
+        .fileInode = u64(info.st_ino),
+        .fileTime = FileTime(info),
+        .symbolCount = builder.symbols.size(),
+        .lineCount = builder.lines.size(),
+        .stringBytes = builder.strings.size(),
+    };
+    memcpy(header.magic, SYMBOL_CACHE_MAGIC, sizeof(header.magic));
+
+    std::vector<u8> &index = module->storage;
+    u64 symbolBytes = header.symbolCount * sizeof(SymbolModule::Symbol);
+    u64 lineBytes = header.lineCount * sizeof(SymbolModule::Line);
+    index.resize(sizeof(header) + symbolBytes + lineBytes + header.stringBytes);
+    memcpy(index.data(), &header, sizeof(header));
+    memcpy(index.data() + sizeof(header), builder.symbols.data(), symbolBytes);
+    memcpy(index.data() + sizeof(header) + symbolBytes, builder.lines.data(), lineBytes);
+    memcpy(index.data() + sizeof(header) + symbolBytes + lineBytes, builder.strings.data(), header.stringBytes);
+    UseIndex(*module, index.data(), index.size());
+
+    if (!cachePath.empty())
+        WriteCachedIndex(index, cachePath);
+    return module;
+}
+
+struct LoadedModule
+{
+    std::string path;
+    u64 bias, begin, end;
+};
+
+internal int CollectModule(dl_phdr_info *info, size_t, void *context)
+{
+    auto *loaded = (std::vector<LoadedModule> *)context;
+
+    LoadedModule module = {.path = info->dlpi_name ? info->dlpi_name : "", .bias = info->dlpi_addr, .begin = ~0ull, .end = 0};
+    if (module.path.empty())
+    {
+        // The main executable has no name here.
+        char self[4096];
+        i64 len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (len <= 0 || !loaded->empty())
+            return 0;
+        module.path.assign(self, u64(len));
+    }
+
+    for (u32 i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr) &segment = info->dlpi_phdr[i];
+        if (segment.p_type != PT_LOAD)
+            continue;
+        module.begin = std::min<u64>(module.begin, info->dlpi_addr + segment.p_vaddr);
+        module.end = std::max<u64>(module.end, info->dlpi_addr + segment.p_vaddr + segment.p_memsz);
+    }
+
+    if (module.begin < module.end)
+        loaded->push_back(module);
+    return 0;
+}
+
+// Modules ever loaded by the dynamic linker. Stops at the first module, so it costs a lock and no
+// stat calls.
+internal int CountLoads(dl_phdr_info *info, size_t, void *context)
+{
+    *(u64 *)context = info->dlpi_adds;
+    return 1;
+}
+
+internal u64 ReadModuleLoads()
+{
+    u64 loads = 0;
+    dl_iterate_phdr(CountLoads, &loads);
+    return loads;
+}
+
+void Symbolizer::Load(cstr dir)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (dir)
+    {
+        cacheDir = dir;
+    }
+    else if (cacheDir.empty())
+    {
+        cstr xdg = getenv("XDG_CACHE_HOME");
+        cstr home = getenv("HOME");
+        if (xdg && xdg[0])
+            cacheDir = std::string(xdg) + "/profiler";
+        else if (home && home[0])
+            cacheDir = std::string(home) + "/.cache/profiler";
+
+        if (!cacheDir.empty())
+        {
+            mkdir(cacheDir.substr(0, cacheDir.find_last_of('/')).c_str(), 0755);
+            mkdir(cacheDir.c_str(), 0755);
+        }
+    }
+
+    // Counted before the scan, so a module loaded during it causes another one.
+    scannedLoads = ReadModuleLoads();
+    std::vector<LoadedModule> present;
+    dl_iterate_phdr(CollectModule, &present);
+
+    for (LoadedModule &candidate : present)
+    {
+        bool known = false;
+        for (SymbolModule *module : modules)
+            known = known || (module->begin == candidate.begin && module->path == candidate.path);
+        if (known)
+            continue;
+
+        // The vDSO and anything else without a file on disk are skipped.
+        SymbolModule *module = IndexModule(candidate.path, cacheDir);
+        if (!module)
+            continue;
+
+        module->bias = candidate.bias;
+        module->begin = candidate.begin;
+        module->end = candidate.end;
+        modules.push_back(module);
+    }
+
+    loaded.store(true, std::memory_order_release);
+}
+
+bool Symbolizer::Resolve(void *address, SymbolLocation *location)
+{
+    if (!loaded.load(std::memory_order_acquire))
+        Load();
+
+    u64 at = u64(address);
+    SymbolModule *found = nullptr;
+    for (u32 attempt = 0; attempt < 2 && !found; attempt++)
+    {
+        u64 scanned;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (SymbolModule *module : modules)
+                found = at >= module->begin && at < module->end ? module : found;
+            scanned = scannedLoads;
+        }
+
+        // Loaded after the last scan, e.g. through dlopen. Addresses no module covers (JIT code,
+        // the vDSO) only rescan when something was loaded since.
+        if (!found && attempt == 0 && ReadModuleLoads() != scanned)
+            Load();
+    }
+    if (!found)
+        return false;
+
+    u64 relative = at - found->bias;
+    const SymbolModule::Symbol *symbols = found->symbols;
+    const SymbolModule::Symbol *symbol = std::upper_bound(symbols,
+                                                          symbols + found->symbolCount,
+                                                          relative,
+                                                          [](u64 value, const SymbolModule::Symbol &entry)
+                                                          { return value < entry.address; });
+    if (symbol == symbols)
+        return false;
+    symbol--;
+    if (symbol->size && relative >= symbol->address + symbol->size)
+        return false;
+
+    location->function = found->strings + symbol->name;
+    location->module = found->path.c_str();
+    location->offset = relative - symbol->address;
+    location->file = "";
+    location->line = 0;
+
+    const SymbolModule::Line *lines = found->lines;
+    const SymbolModule::Line *line = std::upper_bound(lines,
+                                                      lines + found->lineCount,
+                                                      relative,
+                                                      [](u64 value, const SymbolModule::Line &entry)
+                                                      { return value < entry.address; });
+    if (line != lines && (line - 1)->line != 0)
+    {
+        location->file = found->strings + (line - 1)->file;
+        location->line = (line - 1)->line;
+    }
+
+    return true;
+}
+
+#else
+
+void Symbolizer::Load(cstr dir) { loaded.store(true, std::memory_order_release); }
+
+bool Symbolizer::Resolve(void *address, SymbolLocation *location) { return false; }
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+// Standard headers go first: types.hpp defines `global`, which collides with libstdc++ internals.
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+
+// Where an address is, as far as the symbol tables and line tables know.
+struct SymbolLocation
+{
+    cstr function; // Demangled
+    cstr module;   // Path of the executable or shared object
+    cstr file;     // Source file, or "" without line tables
+    u32 line;
+    u64 offset; // From the start of the function
+};
+
+// Index of one loaded module. Addresses are file virtual addresses; subtract `bias` from a
+// runtime address first.
+struct SymbolModule
+{
+    struct Symbol
+    {
+        u64 address, size;
+        u32 name, pad;
+    };
+
+    // Line 0 ends a sequence: addresses from there on have no line information.
+    struct Line
+    {
+        u64 address;
+        u32 file, line;
+    };
+
+    std::string path;
+    u64 bias, begin, end; // Runtime address range
+
+    const Symbol *symbols;
+    const Line *lines;
+    const char *strings;
+    u64 symbolCount, lineCount, stringBytes;
+
+    std::vector<u8> storage; // When the index couldn't be cached, it lives here
+    void *mapping;
+    u64 mappingSize;
+    bool cached; // Loaded from the disk cache instead of parsed
+};
+
+// Resolves addresses in the running process by binary search over per-module indexes built from
+// .symtab/.dynsym and DWARF .debug_line. Indexes are cached in `cacheDir` (by default
+// $XDG_CACHE_HOME/profiler or ~/.cache/profiler), keyed by path, size, inode and modification time, so
+// later runs map them instead of parsing ELF again. Only implemented for ELF; elsewhere Resolve
+// returns false and callers fall back to ResolveSymbol.
+struct Symbolizer
+{
+    std::vector<SymbolModule *> modules;
+    std::string cacheDir;
+    std::mutex lock;
+    std::atomic<bool> loaded;
+    u64 scannedLoads; // Modules the dynamic linker had ever loaded at the last scan
+
+    static Symbolizer &Get();
+
+    // Indexes every module loaded right now. Resolve calls it on first use, and again for
+    // addresses outside every known module once the dynamic linker loaded more (after dlopen).
+    void Load(cstr cacheDir = nullptr);
+    bool Resolve(void *address, SymbolLocation *location);
+};
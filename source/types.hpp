@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
 
 #define COL_RESET "\033[0m"
@@ -50,7 +52,7 @@ using f64 = double_t;
 // Strip name from variable in macro.
 // @example StripName("Mem->foo.bar") == "bar"
 // @example StripName("Mem->foo") == "foo"
-cstr StripName(cstr var)
+inline cstr StripName(cstr var)
 {
     cstr strippedName = var;
     u64 len = strlen(var);
@@ -74,7 +76,7 @@ constexpr bool IsZero(T value, T epsilon = 0.001f)
 
 namespace Rand
 {
-    u32 Init(u32 seed = 123456789u)
+    inline u32 Init(u32 seed = 123456789u)
     {
         srand(seed);
         INFO("Initialized random seed:\t%d", seed);
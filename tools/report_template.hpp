@@ -0,0 +1,292 @@
+#pragma once
+
+// Static part of the HTML report written by trace_analyzer --html. The analyzer writes
+// ReportHead, then `const DATA = {...};`, then ReportTail. Everything is inline, so the
+// report opens offline. Data is aggregated per call path before it's embedded, so its size
+// depends on the number of distinct paths, not on the number of events.
+//
+// DATA = {
+//   system: {platform, architecture, version, processors, cpuFreq, memory, pageSize} | null,
+//   trace: {file, seconds, events, threads},
+//   freq,                                    // Timer ticks per second
+//   names: [label], files: [file:line],      // Indexed by block id
+//   blocks: [[id, count, ex, inc, bytes, p50, p90, p99, max, [lower, count, ...]]],
+//   tree: [[parent, id, count, inc, ex]],    // Parents come before children, -1 for roots
+// }
+
+#include "types.hpp"
+
+global cstr ReportHead = R"HTML(<!DOCTYPE html>
+<html>
+<head>
+<meta charset="utf-8">
+<title>Profile report</title>
+<style>
+body { font: 13px/1.4 system-ui, sans-serif; margin: 16px; color: #222; background: #fafafa; }
+h1 { font-size: 18px; margin: 0 0 8px; }
+h2 { font-size: 15px; margin: 20px 0 6px; }
+#system { display: flex; flex-wrap: wrap; gap: 4px 24px; color: #555; }
+#system b { color: #222; font-weight: 600; }
+table { border-collapse: collapse; width: 100%; background: #fff; }
+th, td { padding: 3px 8px; border-bottom: 1px solid #e4e4e4; text-align: right; white-space: nowrap; }
+th { cursor: pointer; user-select: none; background: #f0f0f0; position: sticky; top: 0; }
+th:first-child, td:first-child { text-align: left; }
+tr.selected td { background: #fff2d6; }
+tbody tr { cursor: pointer; }
+tbody tr:hover td { background: #f5f5f5; }
+canvas { display: block; background: #fff; border: 1px solid #e4e4e4; }
+#tooltip { position: fixed; pointer-events: none; background: #222; color: #fff; padding: 4px 8px;
+           border-radius: 3px; font-size: 12px; display: none; white-space: pre; }
+.hint { color: #777; font-size: 12px; }
+</style>
+</head>
+<body>
+<h1 id="title">Profile report</h1>
+<div id="system"></div>
+<h2>Blocks</h2>
+<table><thead id="head"></thead><tbody id="rows"></tbody></table>
+<h2 id="histogramTitle">Durations</h2>
+<div class="hint">Click a block in the table to show the distribution of its executions.</div>
+<canvas id="histogram" height="160"></canvas>
+<h2>Flame graph</h2>
+<div class="hint">Width is inclusive time. Click to zoom in, click the top bar to zoom out.</div>
+<canvas id="flame"></canvas>
+<div id="tooltip"></div>
+<script>
+)HTML";
+
+global cstr ReportTail = R"HTML(
+const D = DATA;
+const $ = id => document.getElementById(id);
+
+function formatTime(ticks) {
+  const s = ticks / D.freq;
+  if (s >= 1) return s.toFixed(3) + ' s';
+  if (s >= 1e-3) return (s * 1e3).toFixed(3) + ' ms';
+  return (s * 1e6).toFixed(2) + ' us';
+}
+
+function formatRate(bytes, ticks) {
+  if (!bytes || !ticks) return '';
+  return (bytes / (ticks / D.freq) / 1024 / 1024 / 1024).toFixed(3) + ' GB/s';
+}
+
+function percent(ticks) { return (ticks / (D.trace.seconds * D.freq) * 100).toFixed(2) + '%'; }
+
+// Header
+{
+  const items = [['Trace', D.trace.file], ['Duration', D.trace.seconds.toFixed(6) + ' s'],
+                 ['Events', D.trace.events.toLocaleString()], ['Threads', D.trace.threads]];
+  if (D.system) {
+    const s = D.system;
+    items.push(['Platform', s.platform + ' ' + s.architecture], ['Version', s.version],
+               ['Processors', s.processors], ['CPU timer', s.cpuFreq.toFixed(2) + ' GHz'],
+               ['Memory', s.memory + ' MB'], ['Page size', s.pageSize + ' bytes']);
+  }
+  $('title').textContent = 'Profile report: ' + D.trace.file;
+  for (const [key, value] of items) {
+    const span = document.createElement('span');
+    span.innerHTML = '<b></b> ';
+    span.firstChild.textContent = key + ':';
+    span.appendChild(document.createTextNode(value));
+    $('system').appendChild(span);
+  }
+}
+
+// Block table
+const columns = [
+  ['Name', b => D.names[b[0]], b => D.names[b[0]]],
+  ['Count', b => b[1], b => b[1].toLocaleString()],
+  ['Time (Ex)', b => b[2], b => formatTime(b[2])],
+  ['Ex %', b => b[2], b => percent(b[2])],
+  ['Time (Inc)', b => b[3], b => formatTime(b[3])],
+  ['Inc %', b => b[3], b => percent(b[3])],
+  ['Bandwidth', b => b[2] ? b[4] / b[2] : 0, b => formatRate(b[4], b[2])],
+  ['p50', b => b[5], b => formatTime(b[5])],
+  ['p90', b => b[6], b => formatTime(b[6])],
+  ['p99', b => b[7], b => formatTime(b[7])],
+  ['Max', b => b[8], b => formatTime(b[8])],
+];
+let sortColumn = 2, sortDescending = true, selected = -1;
+
+function renderTable() {
+  const head = $('head'), rows = $('rows');
+  head.innerHTML = '';
+  const tr = document.createElement('tr');
+  columns.forEach(([title], i) => {
+    const th = document.createElement('th');
+    th.textContent = title + (i === sortColumn ? (sortDescending ? ' ▾' : ' ▴') : '');
+    th.onclick = () => {
+      sortDescending = i === sortColumn ? !sortDescending : i !== 0;
+      sortColumn = i;
+      renderTable();
+    };
+    tr.appendChild(th);
+  });
+  head.appendChild(tr);
+
+  const key = columns[sortColumn][1];
+  const sorted = D.blocks.slice().sort((a, b) => {
+    const x = key(a), y = key(b);
+    const order = x < y ? -1 : x > y ? 1 : 0;
+    return sortDescending ? -order : order;
+  });
+
+  rows.innerHTML = '';
+  for (const block of sorted) {
+    const row = document.createElement('tr');
+    if (block[0] === selected) row.className = 'selected';
+    row.title = D.files[block[0]];
+    for (const column of columns) {
+      const td = document.createElement('td');
+      td.textContent = column[2](block);
+      row.appendChild(td);
+    }
+    row.onclick = () => { selected = block[0]; renderTable(); drawHistogram(block); };
+    rows.appendChild(row);
+  }
+}
+
+// Histogram of one block's durations, one bar per log-linear bucket
+function drawHistogram(block) {
+  const canvas = $('histogram'), context = canvas.getContext('2d');
+  canvas.width = canvas.parentElement.clientWidth - 2;
+  context.clearRect(0, 0, canvas.width, canvas.height);
+  $('histogramTitle').textContent = 'Durations: ' + D.names[block[0]];
+
+  const pairs = block[9];
+  const buckets = pairs.length / 2;
+  if (!buckets) return;
+  let most = 0;
+  for (let i = 1; i < pairs.length; i += 2) most = Math.max(most, pairs[i]);
+
+  const left = 8, bottom = 20, width = (canvas.width - 2 * left) / buckets;
+  const height = canvas.height - bottom - 8;
+  context.font = '11px system-ui, sans-serif';
+  for (let i = 0; i < buckets; i++) {
+    const count = pairs[2 * i + 1];
+    const h = Math.max(1, count / most * height);
+    context.fillStyle = '#e8843c';
+    context.fillRect(left + i * width, 8 + height - h, Math.max(1, width - 1), h);
+  }
+
+  context.fillStyle = '#555';
+  context.textAlign = 'left';
+  context.fillText(formatTime(pairs[0]), left, canvas.height - 5);
+  context.textAlign = 'right';
+  context.fillText(formatTime(pairs[pairs.length - 2]), canvas.width - left, canvas.height - 5);
+  context.textAlign = 'center';
+  context.fillText(block[1].toLocaleString() + ' executions, p50 ' + formatTime(block[5]) +
+                   ', p99 ' + formatTime(block[7]), canvas.width / 2, canvas.height - 5);
+}
+
+// Flame graph over the call tree. Node 0 is a synthetic root.
+const nodes = [{parent: -1, id: -1, count: 0, inc: 0, ex: 0, children: [], depth: 0}];
+for (const [parent, id, count, inc, ex] of D.tree) {
+  const node = {parent: parent + 1, id, count, inc, ex, children: []};
+  node.depth = nodes[node.parent].depth + 1;
+  nodes[node.parent].children.push(nodes.length);
+  nodes.push(node);
+}
+for (const child of nodes[0].children) nodes[0].inc += nodes[child].inc;
+for (const node of nodes) node.children.sort((a, b) => nodes[b].inc - nodes[a].inc);
+const maxDepth = nodes.reduce((depth, node) => Math.max(depth, node.depth), 0);
+
+const rowHeight = 18;
+let focus = 0, rects = [];
+
+function color(id) {
+  let hash = 2166136261;
+  for (const c of D.names[id] || '') hash = Math.imul(hash ^ c.charCodeAt(0), 16777619);
+  return 'hsl(' + (10 + (hash >>> 0) % 40) + ', 75%, ' + (55 + (hash >>> 8) % 15) + '%)';
+}
+
+function drawFlame() {
+  const canvas = $('flame'), context = canvas.getContext('2d');
+  canvas.width = canvas.parentElement.clientWidth - 2;
+  canvas.height = (maxDepth + 1) * rowHeight + 2;
+  context.clearRect(0, 0, canvas.width, canvas.height);
+  context.font = '11px system-ui, sans-serif';
+  context.textBaseline = 'middle';
+  rects = [];
+
+  function bar(index, x, width) {
+    const node = nodes[index];
+    const y = node.depth * rowHeight;
+    context.fillStyle = index === 0 ? '#ccc' : color(node.id);
+    context.fillRect(x, y, Math.max(width - 1, 0.5), rowHeight - 1);
+    rects.push([x, y, width, index]);
+    if (width > 30) {
+      let label = index === 0 ? 'all' : D.names[node.id];
+      while (label.length > 1 && context.measureText(label).width > width - 6)
+        label = label.slice(0, -2) + '…';
+      context.fillStyle = '#222';
+      context.fillText(label, x + 3, y + rowHeight / 2);
+    }
+  }
+
+  function layout(index, x, width) {
+    bar(index, x, width);
+    const node = nodes[index];
+    let at = x;
+    for (const child of node.children) {
+      const w = node.inc ? Math.min(nodes[child].inc / node.inc, 1) * width : 0;
+      if (w >= 0.5) layout(child, at, w);
+      at += w;
+    }
+  }
+
+  // Ancestors of the focused node span the whole width.
+  for (let index = nodes[focus].parent; index >= 0; index = nodes[index].parent)
+    bar(index, 0, canvas.width);
+  layout(focus, 0, canvas.width);
+}
+
+function hit(event) {
+  const bounds = $('flame').getBoundingClientRect();
+  const x = event.clientX - bounds.left, y = event.clientY - bounds.top;
+  for (let i = rects.length - 1; i >= 0; i--) {
+    const [rx, ry, rw, index] = rects[i];
+    if (x >= rx && x < rx + rw && y >= ry && y < ry + rowHeight) return index;
+  }
+  return -1;
+}
+
+$('flame').onclick = event => {
+  const index = hit(event);
+  if (index < 0) return;
+  focus = index === focus ? nodes[index].parent : index;
+  focus = Math.max(focus, 0);
+  drawFlame();
+};
+
+$('flame').onmousemove = event => {
+  const tooltip = $('tooltip'), index = hit(event);
+  if (index <= 0) { tooltip.style.display = 'none'; return; }
+  const node = nodes[index];
+  tooltip.textContent = D.names[node.id] + ' [' + node.count.toLocaleString() + ']\n' +
+                        'Inclusive: ' + formatTime(node.inc) + ' (' + percent(node.inc) + ')\n' +
+                        'Exclusive: ' + formatTime(node.ex) + ' (' + percent(node.ex) + ')\n' +
+                        D.files[node.id];
+  tooltip.style.display = 'block';
+  tooltip.style.left = (event.clientX + 12) + 'px';
+  tooltip.style.top = (event.clientY + 12) + 'px';
+};
+$('flame').onmouseleave = () => { $('tooltip').style.display = 'none'; };
+
+renderTable();
+if (D.blocks.length) {
+  selected = D.blocks.slice().sort((a, b) => b[2] - a[2])[0][0];
+  renderTable();
+  drawHistogram(D.blocks.find(b => b[0] === selected));
+}
+drawFlame();
+window.onresize = () => {
+  drawFlame();
+  const block = D.blocks.find(b => b[0] === selected);
+  if (block) drawHistogram(block);
+};
+</script>
+</body>
+</html>
+)HTML";
@@ -0,0 +1,1049 @@
+// Offline analyzer for flight recorder traces. Computes what Profiler::End reports (exclusive
+// and inclusive time, bandwidth) plus percentiles, the call tree, flows and counters, optionally
+// restricted to a time window or a single thread. Streams are split into chunks that are
+// analyzed on all cores and merged.
+//
+// trace_analyzer <file.trace> [--from secs] [--to secs] [--thread tid] [--jobs n]
+//                             [--chrome out.json] [--html out.html]
+// trace_analyzer <fleet file> --fleet
+
+// Standard headers go first: types.hpp defines `global`, which collides with libstdc++ internals.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "types.hpp"
+#include "trace.hpp"
+#include "fleet.hpp"
+#include "report_template.hpp"
+
+#ifndef CHUNK_EVENTS
+#define CHUNK_EVENTS (1 << 20)
+#endif
+
+// Log-linear buckets: 8 sub-buckets per power of two, so percentiles are within ~12%.
+struct LatencyHistogram
+{
+    u64 buckets[64 * 8];
+
+    static u32 Bucket(u64 value)
+    {
+        if (value < 8)
+            return u32(value);
+
+        u32 exponent = 63 - u32(__builtin_clzll(value));
+        return (exponent - 2) * 8 + u32((value >> (exponent - 3)) & 7);
+    }
+
+    static u64 Lower(u32 bucket)
+    {
+        if (bucket < 8)
+            return bucket;
+
+        u32 exponent = bucket / 8 + 2;
+        return (u64(8 | (bucket & 7))) << (exponent - 3);
+    }
+
+    void Add(u64 value) { buckets[Bucket(value)]++; }
+
+    void Merge(const LatencyHistogram &other)
+    {
+        for (u32 i = 0; i < 64 * 8; i++)
+            buckets[i] += other.buckets[i];
+    }
+
+    u64 Percentile(f64 p) const
+    {
+        u64 count = 0;
+        for (u64 bucket : buckets)
+            count += bucket;
+        if (count == 0)
+            return 0;
+
+        u64 target = u64(ceil(p * f64(count)));
+        u64 seen = 0;
+        for (u32 i = 0; i < 64 * 8; i++)
+        {
+            seen += buckets[i];
+            if (seen >= target && seen > 0)
+                return Lower(i);
+        }
+        return 0;
+    }
+};
+
+struct BlockStats
+{
+    u64 count, timeEx, timeInc, bytes, max;
+    LatencyHistogram durations;
+
+    void Merge(const BlockStats &other)
+    {
+        count += other.count;
+        timeEx += other.timeEx;
+        timeInc += other.timeInc;
+        bytes += other.bytes;
+        max = other.max > max ? other.max : max;
+        durations.Merge(other.durations);
+    }
+};
+
+// Call tree nodes are keyed by a hash of their path, so chunks can build them independently.
+struct TreeNode
+{
+    u64 parent;
+    u32 id, depth;
+    u64 count, timeEx, timeInc;
+};
+
+struct CounterStats
+{
+    u64 count, lastTime;
+    f64 min, max, sum, last;
+};
+
+struct FlowEvent
+{
+    u64 time, item;
+    u32 flow, thread;
+};
+
+struct Frame
+{
+    u32 id;
+    u64 begin, path;
+};
+
+struct Chunk
+{
+    u32 stream;
+    const TraceEvent *events; // In the mapped file
+    u64 len;
+
+    // Pass 1: effect of the chunk on the stack, ignoring what came before it.
+    u64 unmatchedEnds;
+    std::vector<Frame> opened;
+
+    // Pass 2 input: stack and time of the previous event when the chunk starts.
+    std::vector<Frame> startStack;
+    u64 startTime;
+
+    // Pass 2 output
+    std::vector<BlockStats> blocks;
+    std::unordered_map<u64, TreeNode> tree;
+    std::vector<CounterStats> counters;
+    std::vector<FlowEvent> flowBegins, flowEnds;
+    u64 first, last;
+};
+
+struct Stream
+{
+    TraceThread info;
+    const TraceEvent *events; // In the mapped file
+};
+
+struct Name
+{
+    std::string label, file;
+    u32 line;
+};
+
+struct Trace
+{
+    const u8 *data; // The whole file, mapped read-only
+    u64 size;
+    TraceHeader header;
+    TraceSystem system;
+    bool hasSystem;
+    std::vector<Name> blockNames, flowNames, counterNames;
+    std::vector<Stream> streams;
+};
+
+struct Options
+{
+    cstr path, chromePath, htmlPath;
+    f64 from, to;
+    u32 thread, jobs;
+    bool hasThread;
+    bool fleet; // `path` is a PROFILER_FLEET file instead of a trace
+};
+
+internal u64 PathHash(u64 parent, u32 id)
+{
+    u64 hash = parent ^ (0x9E3779B97F4A7C15ull + id);
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+// Prints the merged report of a fleet file, which the workers may still be writing.
+internal bool ReportFleet(cstr path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        ERR("Couldn't open %s", path);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    u64 size = u64(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    std::vector<u8> data(size > sizeof(FleetHeader) ? size : sizeof(FleetHeader));
+    u64 read = fread(data.data(), 1, size, file);
+    fclose(file);
+
+    FleetHeader *header = (FleetHeader *)data.data();
+    if (read != size || size < sizeof(FleetHeader) || memcmp(header->magic, FLEET_MAGIC, 8) != 0 ||
+        header->version != FLEET_VERSION || size < FleetBytes(header->maxWorkers, header->maxBlocks))
+    {
+        ERR("%s isn't a fleet file", path);
+        return false;
+    }
+
+    PrintFleetReport(header);
+    return true;
+}
+
+// Maps the file instead of reading it: captures run to gigabytes, and the chunk workers read
+// their events in place.
+internal bool LoadTrace(cstr path, Trace &trace)
+{
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        ERR("Couldn't open %s", path);
+        return false;
+    }
+
+    struct stat info;
+    u64 size = fstat(fd, &info) == 0 ? u64(info.st_size) : 0;
+    void *mapping = MAP_FAILED;
+    if (size >= sizeof(TraceHeader))
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        ERR("Couldn't read %s", path);
+        return false;
+    }
+
+    trace.data = (const u8 *)mapping;
+    trace.size = size;
+
+    const u8 *cursor = trace.data;
+    const u8 *end = cursor + size;
+    memcpy(&trace.header, cursor, sizeof(TraceHeader));
+    cursor += sizeof(TraceHeader);
+
+    if (memcmp(trace.header.magic, TRACE_MAGIC, sizeof(trace.header.magic)) != 0 ||
+        trace.header.version == 0 || trace.header.version > TRACE_VERSION)
+    {
+        ERR("%s is not a version 1 to %d trace", path, TRACE_VERSION);
+        return false;
+    }
+
+    trace.hasSystem = trace.header.version >= 2;
+    if (trace.hasSystem)
+    {
+        if (cursor + sizeof(TraceSystem) > end)
+            return false;
+        memcpy(&trace.system, cursor, sizeof(TraceSystem));
+        cursor += sizeof(TraceSystem);
+    }
+
+    for (u32 i = 0; i < trace.header.names; i++)
+    {
+        TraceName name;
+        if (cursor + sizeof(name) > end)
+            return false;
+        memcpy(&name, cursor, sizeof(name));
+        cursor += sizeof(name);
+        if (cursor + name.labelLen + name.fileLen > end)
+            return false;
+
+        Name entry = {
+            .label = std::string((cstr)cursor, name.labelLen),
+            .file = std::string((cstr)cursor + name.labelLen, name.fileLen),
+            .line = name.line,
+        };
+        cursor += name.labelLen + name.fileLen;
+
+        std::vector<Name> &names = name.kind == TraceNameBlock  ? trace.blockNames
+                                   : name.kind == TraceNameFlow ? trace.flowNames
+                                                                : trace.counterNames;
+        if (names.size() <= name.id)
+            names.resize(name.id + 1);
+        names[name.id] = entry;
+    }
+
+    for (u32 i = 0; i < trace.header.threads; i++)
+    {
+        Stream stream;
+        if (cursor + sizeof(TraceThread) > end)
+            return false;
+        memcpy(&stream.info, cursor, sizeof(TraceThread));
+        cursor += sizeof(TraceThread);
+
+        stream.events = (const TraceEvent *)cursor;
+        if (cursor + stream.info.events * sizeof(TraceEvent) > end)
+            return false;
+        cursor += stream.info.events * sizeof(TraceEvent);
+        trace.streams.push_back(stream);
+    }
+
+    return true;
+}
+
+// Runs `work(i)` for i in [0, count) on `jobs` threads.
+template <typename Work>
+internal void ParallelFor(u64 count, u32 jobs, Work work)
+{
+    std::atomic<u64> next{0};
+    std::vector<std::thread> threads;
+    for (u32 i = 0; i < jobs; i++)
+    {
+        threads.emplace_back(
+            [&]
+            {
+                for (u64 item = next++; item < count; item = next++)
+                    work(item);
+            });
+    }
+    for (auto &thread : threads)
+        thread.join();
+}
+
+internal void FindOpenFrames(Chunk &chunk)
+{
+    for (u64 i = 0; i < chunk.len; i++)
+    {
+        const TraceEvent &event = chunk.events[i];
+        if (event.kind == TraceBegin)
+        {
+            chunk.opened.push_back(Frame{.id = event.id, .begin = event.time, .path = 0});
+        }
+        else if (event.kind == TraceEnd)
+        {
+            if (chunk.opened.empty())
+                chunk.unmatchedEnds++;
+            else
+                chunk.opened.pop_back();
+        }
+    }
+}
+
+// Exclusive time is charged per segment to whichever frame is on top, clipped to the window.
+// Counts, inclusive time and percentiles go to executions that end inside the window.
+internal void AnalyzeChunk(Chunk &chunk, u32 thread, u64 from, u64 to, u64 blockCount, u64 counterCount)
+{
+    chunk.blocks.resize(blockCount);
+    chunk.counters.resize(counterCount);
+    chunk.first = ~0ull;
+    chunk.last = 0;
+
+    std::vector<Frame> stack = chunk.startStack;
+    std::vector<u32> depth(blockCount);
+    for (u64 i = 0; i < stack.size(); i++)
+    {
+        stack[i].path = PathHash(i ? stack[i - 1].path : 0, stack[i].id);
+        if (stack[i].id < blockCount)
+            depth[stack[i].id]++;
+    }
+
+    u64 last = chunk.startTime;
+    for (u64 i = 0; i < chunk.len; i++)
+    {
+        const TraceEvent &event = chunk.events[i];
+        u64 time = event.time;
+
+        if (!stack.empty() && last)
+        {
+            u64 segmentFrom = last > from ? last : from;
+            u64 segmentTo = time < to ? time : to;
+            if (segmentTo > segmentFrom)
+            {
+                Frame &top = stack.back();
+                if (top.id < blockCount)
+                    chunk.blocks[top.id].timeEx += segmentTo - segmentFrom;
+                chunk.tree[top.path].timeEx += segmentTo - segmentFrom;
+            }
+        }
+        last = time;
+
+        bool inWindow = time >= from && time <= to;
+        if (inWindow)
+        {
+            chunk.first = time < chunk.first ? time : chunk.first;
+            chunk.last = time > chunk.last ? time : chunk.last;
+        }
+
+        switch (event.kind)
+        {
+        case TraceBegin:
+        {
+            u64 parent = stack.empty() ? 0 : stack.back().path;
+            Frame frame = {.id = event.id, .begin = time, .path = PathHash(parent, event.id)};
+            TreeNode &node = chunk.tree[frame.path];
+            node.parent = parent;
+            node.id = event.id;
+            node.depth = u32(stack.size());
+            stack.push_back(frame);
+            if (event.id < blockCount)
+                depth[event.id]++;
+        }
+        break;
+
+        case TraceEnd:
+        {
+            // Ends whose begin was overwritten before the dump are skipped.
+            if (stack.empty())
+                break;
+
+            Frame frame = stack.back();
+            stack.pop_back();
+            if (frame.id >= blockCount)
+                break;
+
+            depth[frame.id]--;
+            if (!inWindow)
+                break;
+
+            u64 duration = time - frame.begin;
+            BlockStats &block = chunk.blocks[frame.id];
+            block.count++;
+            block.bytes += event.value;
+            block.durations.Add(duration);
+            block.max = duration > block.max ? duration : block.max;
+            if (depth[frame.id] == 0) // Outermost recursion level only
+                block.timeInc += duration;
+
+            TreeNode &node = chunk.tree[frame.path];
+            node.count++;
+            node.timeInc += duration;
+        }
+        break;
+
+        case TraceFlowBegin:
+            chunk.flowBegins.push_back(FlowEvent{time, event.value, event.id, thread});
+            break;
+
+        case TraceFlowEnd:
+            if (inWindow)
+                chunk.flowEnds.push_back(FlowEvent{time, event.value, event.id, thread});
+            break;
+
+        case TraceCounter:
+        {
+            if (!inWindow || event.id >= counterCount)
+                break;
+
+            f64 value;
+            memcpy(&value, &event.value, sizeof(value));
+            CounterStats &counter = chunk.counters[event.id];
+            if (counter.count == 0 || value < counter.min)
+                counter.min = value;
+            if (counter.count == 0 || value > counter.max)
+                counter.max = value;
+            if (time >= counter.lastTime)
+            {
+                counter.last = value;
+                counter.lastTime = time;
+            }
+            counter.sum += value;
+            counter.count++;
+        }
+        break;
+        }
+    }
+}
+
+internal void PrintTree(const std::unordered_map<u64, TreeNode> &tree,
+                        const std::unordered_map<u64, std::vector<u64>> &children,
+                        const Trace &trace,
+                        u64 path,
+                        f64 freq,
+                        f64 total)
+{
+    auto found = children.find(path);
+    if (found == children.end())
+        return;
+
+    std::vector<u64> sorted = found->second;
+    std::sort(sorted.begin(),
+              sorted.end(),
+              [&](u64 a, u64 b) { return tree.at(a).timeInc > tree.at(b).timeInc; });
+
+    for (u64 child : sorted)
+    {
+        const TreeNode &node = tree.at(child);
+        cstr label = node.id < trace.blockNames.size() ? trace.blockNames[node.id].label.c_str() : "?";
+        printf(" %*s%-*s [%llu] \t| %.5f secs\t(%.2f%%) \t| %.5f secs\n",
+               i32(node.depth * 2),
+               "",
+               i32(24 - node.depth * 2 > 4 ? 24 - node.depth * 2 : 4),
+               label,
+               (unsigned long long)node.count,
+               f64(node.timeInc) / freq,
+               f64(node.timeInc) / freq / total * 100,
+               f64(node.timeEx) / freq);
+        PrintTree(tree, children, trace, child, freq, total);
+    }
+}
+
+// JSON string, also safe inside a <script> element.
+internal void WriteJSONString(FILE *out, const std::string &value)
+{
+    fputc('"', out);
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (u8(c) < 0x20 || c == '<')
+            fprintf(out, "\\u%04x", u8(c));
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+internal void WriteChrome(cstr path, const Trace &trace, const Options &options, u64 from, u64 to)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        ERR("Couldn't open %s", path);
+        return;
+    }
+
+    f64 toUs = 1e6 / f64(trace.header.freq);
+    const std::string unknown = "?";
+    auto name = [&](const std::vector<Name> &names, u32 id) -> const std::string &
+    { return id < names.size() && !names[id].label.empty() ? names[id].label : unknown; };
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (const Stream &stream : trace.streams)
+    {
+        if (options.hasThread && stream.info.thread != options.thread)
+            continue;
+
+        for (u64 i = 0; i < stream.info.events; i++)
+        {
+            const TraceEvent &event = stream.events[i];
+            if (event.time < from || event.time > to)
+                continue;
+
+            f64 ts = f64(i64(event.time - trace.header.start)) * toUs;
+            cstr separator = first ? "" : ",\n";
+            first = false;
+            switch (event.kind)
+            {
+            case TraceBegin:
+            case TraceEnd:
+                fprintf(out, "%s{\"name\":", separator);
+                WriteJSONString(out, name(trace.blockNames, event.id));
+                fprintf(out,
+                        ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%u}",
+                        event.kind == TraceBegin ? "B" : "E",
+                        ts,
+                        stream.info.thread);
+                break;
+
+            // Flow arrows bind to the enclosing slices on the producer and consumer threads.
+            case TraceFlowBegin:
+            case TraceFlowEnd:
+                fprintf(out, "%s{\"name\":", separator);
+                WriteJSONString(out, name(trace.flowNames, event.id));
+                fprintf(out,
+                        ",\"cat\":\"flow\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":\"%u:%llu\","
+                        "\"ts\":%.3f,\"pid\":0,\"tid\":%u}",
+                        event.kind == TraceFlowBegin ? "s" : "f",
+                        event.id,
+                        (unsigned long long)event.value,
+                        ts,
+                        stream.info.thread);
+                break;
+
+            case TraceCounter:
+            {
+                f64 value;
+                memcpy(&value, &event.value, sizeof(value));
+                fprintf(out, "%s{\"name\":", separator);
+                WriteJSONString(out, name(trace.counterNames, event.id));
+                fprintf(out,
+                        ",\"ph\":\"C\",\"ts\":%.3f,\"pid\":0,\"args\":{\"value\":%g}}",
+                        ts,
+                        value);
+            }
+            break;
+
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    INFO("Wrote %s", path);
+}
+
+internal void WriteHTML(cstr path,
+                        const Trace &trace,
+                        cstr tracePath,
+                        const std::vector<BlockStats> &blocks,
+                        const std::unordered_map<u64, TreeNode> &tree,
+                        u64 duration,
+                        u64 eventCount)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        ERR("Couldn't open %s", path);
+        return;
+    }
+
+    fputs(ReportHead, out);
+    fprintf(out, "const DATA = {\n\"system\": ");
+    if (trace.hasSystem)
+    {
+        const TraceSystem &system = trace.system;
+        fprintf(out, "{\"platform\": ");
+        WriteJSONString(out, std::string(system.platform, strnlen(system.platform, sizeof(system.platform))));
+        fprintf(out, ", \"architecture\": ");
+        WriteJSONString(out,
+                        std::string(system.architecture, strnlen(system.architecture, sizeof(system.architecture))));
+        fprintf(out,
+                ", \"version\": \"%u.%u.%u\", \"processors\": %u, \"cpuFreq\": %.3f, \"memory\": %llu, "
+                "\"pageSize\": %u}",
+                system.majorVersion,
+                system.minorVersion,
+                system.buildNumber,
+                system.processors,
+                f64(system.cpuTimerFreq) / 1e9,
+                (unsigned long long)(system.totalPhys / (1024 * 1024)),
+                system.pageSize);
+    }
+    else
+    {
+        fprintf(out, "null");
+    }
+
+    fprintf(out, ",\n\"trace\": {\"file\": ");
+    WriteJSONString(out, tracePath);
+    fprintf(out,
+            ", \"seconds\": %.9f, \"events\": %llu, \"threads\": %zu},\n\"freq\": %llu,\n",
+            f64(duration) / f64(trace.header.freq),
+            (unsigned long long)eventCount,
+            trace.streams.size(),
+            (unsigned long long)trace.header.freq);
+
+    fprintf(out, "\"names\": [");
+    for (u64 i = 0; i < trace.blockNames.size(); i++)
+    {
+        fprintf(out, i ? "," : "");
+        WriteJSONString(out, trace.blockNames[i].label);
+    }
+    fprintf(out, "],\n\"files\": [");
+    for (u64 i = 0; i < trace.blockNames.size(); i++)
+    {
+        const Name &name = trace.blockNames[i];
+        fprintf(out, i ? "," : "");
+        WriteJSONString(out, name.file.empty() ? "" : name.file + ":" + std::to_string(name.line));
+    }
+
+    fprintf(out, "],\n\"blocks\": [");
+    bool firstBlock = true;
+    for (u64 i = 0; i < blocks.size(); i++)
+    {
+        const BlockStats &block = blocks[i];
+        if (block.count == 0 && block.timeEx == 0)
+            continue;
+
+        fprintf(out,
+                "%s\n[%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,[",
+                firstBlock ? "" : ",",
+                (unsigned long long)i,
+                (unsigned long long)block.count,
+                (unsigned long long)block.timeEx,
+                (unsigned long long)block.timeInc,
+                (unsigned long long)block.bytes,
+                (unsigned long long)block.durations.Percentile(0.50),
+                (unsigned long long)block.durations.Percentile(0.90),
+                (unsigned long long)block.durations.Percentile(0.99),
+                (unsigned long long)block.max);
+        firstBlock = false;
+
+        bool firstBucket = true;
+        for (u32 bucket = 0; bucket < 64 * 8; bucket++)
+        {
+            if (!block.durations.buckets[bucket])
+                continue;
+            fprintf(out,
+                    "%s%llu,%llu",
+                    firstBucket ? "" : ",",
+                    (unsigned long long)LatencyHistogram::Lower(bucket),
+                    (unsigned long long)block.durations.buckets[bucket]);
+            firstBucket = false;
+        }
+        fprintf(out, "]]");
+    }
+
+    // Depth first, so parents precede their children.
+    std::unordered_map<u64, std::vector<u64>> children;
+    for (auto &[hash, node] : tree)
+        children[node.parent].push_back(hash);
+
+    fprintf(out, "],\n\"tree\": [");
+    std::unordered_map<u64, i64> indices;
+    std::vector<u64> stack = children[0];
+    i64 index = 0;
+    while (!stack.empty())
+    {
+        u64 hash = stack.back();
+        stack.pop_back();
+
+        const TreeNode &node = tree.at(hash);
+        auto parent = indices.find(node.parent);
+        fprintf(out,
+                "%s\n[%lld,%u,%llu,%llu,%llu]",
+                index ? "," : "",
+                (long long)(parent == indices.end() ? -1 : parent->second),
+                node.id,
+                (unsigned long long)node.count,
+                (unsigned long long)node.timeInc,
+                (unsigned long long)node.timeEx);
+        indices[hash] = index++;
+
+        auto found = children.find(hash);
+        if (found != children.end())
+            stack.insert(stack.end(), found->second.begin(), found->second.end());
+    }
+    fprintf(out, "]\n};\n");
+
+    fputs(ReportTail, out);
+    fclose(out);
+    INFO("Wrote %s", path);
+}
+
+internal bool ParseOptions(i32 argc, char **argv, Options &options)
+{
+    options = Options{.path = nullptr, .chromePath = nullptr, .htmlPath = nullptr, .from = -1, .to = -1};
+    options.jobs = std::thread::hardware_concurrency();
+
+    for (i32 i = 1; i < argc; i++)
+    {
+        cstr arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "--from") == 0 && hasValue)
+            options.from = atof(argv[++i]);
+        else if (strcmp(arg, "--to") == 0 && hasValue)
+            options.to = atof(argv[++i]);
+        else if (strcmp(arg, "--thread") == 0 && hasValue)
+            options.thread = u32(atoi(argv[++i])), options.hasThread = true;
+        else if (strcmp(arg, "--jobs") == 0 && hasValue)
+            options.jobs = u32(atoi(argv[++i]));
+        else if (strcmp(arg, "--chrome") == 0 && hasValue)
+            options.chromePath = argv[++i];
+        else if (strcmp(arg, "--html") == 0 && hasValue)
+            options.htmlPath = argv[++i];
+        else if (strcmp(arg, "--fleet") == 0)
+            options.fleet = true;
+        else if (arg[0] != '-' && !options.path)
+            options.path = arg;
+        else
+            return false;
+    }
+
+    options.jobs = options.jobs ? options.jobs : 1;
+    return options.path != nullptr;
+}
+
+int main(i32 argc, char **argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        printf("Usage: %s <file.trace> [--from secs] [--to secs] [--thread tid] [--jobs n] "
+               "[--chrome out.json] [--html out.html]\n"
+               "       %s <fleet file> --fleet\n",
+               argv[0],
+               argv[0]);
+        return 1;
+    }
+
+    if (options.fleet)
+        return ReportFleet(options.path) ? 0 : 1;
+
+    Trace trace = {};
+    if (!LoadTrace(options.path, trace))
+        return 1;
+
+    f64 freq = f64(trace.header.freq);
+    u64 from = options.from >= 0 ? trace.header.start + u64(options.from * freq) : 0;
+    u64 to = options.to >= 0 ? trace.header.start + u64(options.to * freq) : ~0ull;
+    u64 blockCount = trace.blockNames.size();
+    u64 counterCount = trace.counterNames.size();
+
+    // Split every selected stream into fixed-size chunks.
+    std::vector<Chunk> chunks;
+    std::vector<u64> streamChunks;
+    for (u32 s = 0; s < trace.streams.size(); s++)
+    {
+        Stream &stream = trace.streams[s];
+        if (options.hasThread && stream.info.thread != options.thread)
+            continue;
+
+        streamChunks.push_back(chunks.size());
+        for (u64 at = 0; at < stream.info.events; at += CHUNK_EVENTS)
+        {
+            Chunk chunk = {};
+            chunk.stream = s;
+            chunk.events = stream.events + at;
+            chunk.len = stream.info.events - at < CHUNK_EVENTS ? stream.info.events - at : CHUNK_EVENTS;
+            chunks.push_back(std::move(chunk));
+        }
+    }
+    streamChunks.push_back(chunks.size());
+
+    auto started = std::chrono::steady_clock::now();
+
+    // Pass 1 in parallel, then thread each stream's open frames through its chunks in order.
+    ParallelFor(chunks.size(), options.jobs, [&](u64 i) { FindOpenFrames(chunks[i]); });
+    for (u64 s = 0; s + 1 < streamChunks.size(); s++)
+    {
+        std::vector<Frame> stack;
+        for (u64 c = streamChunks[s]; c < streamChunks[s + 1]; c++)
+        {
+            Chunk &chunk = chunks[c];
+            chunk.startStack = stack;
+            chunk.startTime = c > streamChunks[s] ? chunk.events[-1].time : 0;
+            for (u64 i = 0; i < chunk.unmatchedEnds && !stack.empty(); i++)
+                stack.pop_back();
+            stack.insert(stack.end(), chunk.opened.begin(), chunk.opened.end());
+        }
+    }
+
+    ParallelFor(chunks.size(),
+                options.jobs,
+                [&](u64 i)
+                {
+                    Chunk &chunk = chunks[i];
+                    AnalyzeChunk(chunk,
+                                 trace.streams[chunk.stream].info.thread,
+                                 from,
+                                 to,
+                                 blockCount,
+                                 counterCount);
+                });
+
+    // Merge
+    std::vector<BlockStats> blocks(blockCount);
+    std::vector<CounterStats> counters(counterCount);
+    std::unordered_map<u64, TreeNode> tree;
+    std::vector<FlowEvent> flowBegins, flowEnds;
+    u64 first = ~0ull, last = 0;
+    for (Chunk &chunk : chunks)
+    {
+        for (u64 i = 0; i < blockCount; i++)
+            blocks[i].Merge(chunk.blocks[i]);
+
+        for (u64 i = 0; i < counterCount; i++)
+        {
+            CounterStats &into = counters[i], &add = chunk.counters[i];
+            if (add.count == 0)
+                continue;
+            into.min = into.count == 0 || add.min < into.min ? add.min : into.min;
+            into.max = into.count == 0 || add.max > into.max ? add.max : into.max;
+            if (add.lastTime >= into.lastTime)
+            {
+                into.last = add.last;
+                into.lastTime = add.lastTime;
+            }
+            into.sum += add.sum;
+            into.count += add.count;
+        }
+
+        for (auto &[path, node] : chunk.tree)
+        {
+            TreeNode &into = tree[path];
+            if (into.id == 0)
+            {
+                into.parent = node.parent;
+                into.id = node.id;
+                into.depth = node.depth;
+            }
+            into.count += node.count;
+            into.timeEx += node.timeEx;
+            into.timeInc += node.timeInc;
+        }
+
+        flowBegins.insert(flowBegins.end(), chunk.flowBegins.begin(), chunk.flowBegins.end());
+        flowEnds.insert(flowEnds.end(), chunk.flowEnds.begin(), chunk.flowEnds.end());
+        first = chunk.first < first ? chunk.first : first;
+        last = chunk.last > last ? chunk.last : last;
+    }
+
+    f64 elapsed = std::chrono::duration<f64>(std::chrono::steady_clock::now() - started).count();
+    f64 total = last > first ? f64(last - first) / freq : 0.0;
+
+    u64 eventCount = 0;
+    for (Chunk &chunk : chunks)
+        eventCount += chunk.len;
+    INFO("Analyzed %llu events in %llu chunks on %u threads in %.3f seconds",
+         (unsigned long long)eventCount,
+         (unsigned long long)chunks.size(),
+         options.jobs,
+         elapsed);
+    INFO("%s: %.6f seconds of trace", options.path, total);
+    if (trace.hasSystem)
+        INFO("Recorded on %.16s %.16s, %u processors, %.2f GHz CPU timer",
+             trace.system.platform,
+             trace.system.architecture,
+             trace.system.processors,
+             f64(trace.system.cpuTimerFreq) / 1e9);
+    total = total > 0 ? total : 1;
+
+    printf(" %-24s \t| %-25s \t| %-25s \t| %-12s \t| %-10s \t| %-10s \t| %-10s \t| %-10s\n",
+           "Name[n]",
+           "Time (Ex)",
+           "Time (Inc)",
+           "Bandwidth",
+           "p50",
+           "p90",
+           "p99",
+           "Max");
+    printf(
+        "-----------------------------------------------------------------------------------"
+        "--------------------"
+        "--------\n");
+
+    f64 toUs = 1e6 / freq;
+    for (u64 i = 0; i < blockCount; i++)
+    {
+        BlockStats &block = blocks[i];
+        if (block.count == 0 && block.timeEx == 0)
+            continue;
+
+        f64 timeEx = f64(block.timeEx) / freq;
+        f64 timeInc = f64(block.timeInc) / freq;
+        char bandwidth[32] = "";
+        if (block.bytes && timeEx > 0)
+            snprintf(bandwidth, sizeof(bandwidth), "%.3f GB/s", f64(block.bytes) / timeEx / 1024.0 / 1024.0 / 1024.0);
+
+        printf(" %-20s [%llu] \t| %.5f secs\t(%.2f%%) \t| %.5f secs\t(%.2f%%) \t| %-12s \t| %.2f us \t| %.2f us "
+               "\t| %.2f us \t| %.2f us\n",
+               trace.blockNames[i].label.c_str(),
+               (unsigned long long)block.count,
+               timeEx,
+               timeEx / total * 100,
+               timeInc,
+               timeInc / total * 100,
+               bandwidth,
+               f64(block.durations.Percentile(0.50)) * toUs,
+               f64(block.durations.Percentile(0.90)) * toUs,
+               f64(block.durations.Percentile(0.99)) * toUs,
+               f64(block.max) * toUs);
+    }
+
+    INFO("Call tree");
+    printf(" %-24s \t| %-25s \t| %-12s\n", "Name[n]", "Time (Inc)", "Time (Ex)");
+    printf(
+        "-----------------------------------------------------------------------------------"
+        "--------------------"
+        "--------\n");
+    std::unordered_map<u64, std::vector<u64>> children;
+    for (auto &[path, node] : tree)
+        children[node.parent].push_back(path);
+    PrintTree(tree, children, trace, 0, freq, total);
+
+    // Flows pair up across streams, so they're matched after merging.
+    if (!flowEnds.empty())
+    {
+        // Ids may be reused, so each end takes the oldest unmatched begin of its id that came
+        // before it.
+        auto byTime = [](const FlowEvent &a, const FlowEvent &b) { return a.time < b.time; };
+        std::sort(flowBegins.begin(), flowBegins.end(), byTime);
+        std::sort(flowEnds.begin(), flowEnds.end(), byTime);
+
+        struct Pending
+        {
+            std::vector<u64> times;
+            u64 next;
+        };
+        std::unordered_map<u64, Pending> begins;
+        for (FlowEvent &begin : flowBegins)
+            begins[PathHash(begin.item, begin.flow)].times.push_back(begin.time);
+
+        std::vector<LatencyHistogram> latencies(trace.flowNames.size());
+        std::vector<u64> totals(trace.flowNames.size());
+        for (FlowEvent &end : flowEnds)
+        {
+            auto found = begins.find(PathHash(end.item, end.flow));
+            if (found == begins.end() || end.flow >= latencies.size())
+                continue;
+
+            Pending &pending = found->second;
+            if (pending.next == pending.times.size() || pending.times[pending.next] > end.time)
+                continue;
+            u64 begin = pending.times[pending.next++];
+            latencies[end.flow].Add(end.time - begin);
+            totals[end.flow] += end.time - begin;
+        }
+
+        INFO("Flows (handoff latency)");
+        for (u64 i = 0; i < latencies.size(); i++)
+        {
+            u64 count = 0;
+            for (u64 bucket : latencies[i].buckets)
+                count += bucket;
+            if (count == 0)
+                continue;
+
+            printf(" %-20s [%llu] \t| avg %.2f us \t| p50 %.2f us \t| p99 %.2f us\n",
+                   trace.flowNames[i].label.c_str(),
+                   (unsigned long long)count,
+                   f64(totals[i]) / f64(count) * toUs,
+                   f64(latencies[i].Percentile(0.50)) * toUs,
+                   f64(latencies[i].Percentile(0.99)) * toUs);
+        }
+    }
+
+    bool anyCounter = false;
+    for (u64 i = 0; i < counterCount; i++)
+    {
+        CounterStats &counter = counters[i];
+        if (counter.count == 0)
+            continue;
+
+        if (!anyCounter)
+        {
+            anyCounter = true;
+            INFO("Counters");
+        }
+        printf(" %-20s [%llu] \t| min %-12.4g \t| max %-12.4g \t| mean %-12.4g \t| last %-12.4g\n",
+               trace.counterNames[i].label.c_str(),
+               (unsigned long long)counter.count,
+               counter.min,
+               counter.max,
+               counter.sum / f64(counter.count),
+               counter.last);
+    }
+
+    if (options.chromePath)
+        WriteChrome(options.chromePath, trace, options, from, to);
+
+    if (options.htmlPath)
+        WriteHTML(options.htmlPath, trace, options.path, blocks, tree, last > first ? last - first : 0, eventCount);
+
+    munmap((void *)trace.data, trace.size);
+    return 0;
+}